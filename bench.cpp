@@ -0,0 +1,329 @@
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fmt/core.h>
+#include <fstream>
+#include <i3d/diffusion_filters.h>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+using namespace std::literals;
+namespace po = boost::program_options;
+
+// program options (constants after 'parse_args' is called)
+std::size_t po_size = 256;
+std::size_t po_repetitions = 15;
+std::string po_filter;
+std::string po_output_file;
+bool po_quiet = false;
+
+// make sure details are included after program opttions
+#include "details.hpp"
+#include "ced.hpp"
+#include "metaio_io.hpp"
+#include "tiff_io.hpp"
+#include "zarr_io.hpp"
+
+void parse_args(int argc, const char **argv)
+{
+	po::options_description desc("Options");
+	desc.add_options()("help,h", "print help message") // Help
+		("size,s", po::value(&po_size)->default_value(po_size),
+		 "Edge of the benchmark volume in voxels") // Size
+		("repetitions,r", po::value(&po_repetitions)->default_value(po_repetitions),
+		 "Measured runs of every benchmark ( after one warm-up run )") // Repetitions
+		("filter", po::value(&po_filter),
+		 "Run only benchmarks whose name contains this string") // Filter
+		("output_file,o", po::value(&po_output_file),
+		 "Write the results as JSON to this file") // Output
+		("quiet",
+		 "Disable standard output") // Quiet
+		;
+
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
+
+	if (vm.count("help"))
+	{
+		std::cout << "Micro-benchmarks of the ced3dsplit kernels\n"
+				  << desc << std::endl;
+		std::exit(0);
+	}
+
+	if (vm.count("quiet"))
+		po_quiet = true;
+
+	if (po_size < 8 || po_repetitions == 0)
+	{
+		std::cerr << "Size must be at least 8 and repetitions at least 1" << std::endl;
+		std::terminate();
+	}
+}
+
+// Timings of one benchmark, 'bytes' is the memory traffic of one run (read + written)
+struct result
+{
+	std::string name;
+	std::size_t voxels = 0;
+	std::size_t bytes = 0;
+	double median_ns = 0.0;
+	double mad_ns = 0.0;
+	double min_ns = 0.0;
+};
+
+double median(std::vector<double> v)
+{
+	std::sort(v.begin(), v.end());
+	std::size_t n = v.size();
+	return n % 2 ? v[n / 2] : 0.5 * (v[n / 2 - 1] + v[n / 2]);
+}
+
+/*
+ * Runs 'fn' once to warm up and 'po_repetitions' times measured. The median and the median
+ * absolute deviation are reported, so a few runs disturbed by the system do not move the result.
+ */
+template <typename F>
+void measure(std::vector<result> &results, const std::string &name, std::size_t voxels, std::size_t bytes, F &&fn)
+{
+	if (!po_filter.empty() && name.find(po_filter) == std::string::npos)
+		return;
+
+	try
+	{
+		fn();
+
+		std::vector<double> times;
+		for (std::size_t r = 0; r < po_repetitions; ++r)
+		{
+			auto begin = std::chrono::steady_clock::now();
+			fn();
+			times.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count());
+		}
+
+		result res{name, voxels, bytes, median(times)};
+		std::vector<double> deviations;
+		for (double t : times)
+			deviations.push_back(std::abs(t - res.median_ns));
+		res.mad_ns = median(deviations);
+		res.min_ns = *std::min_element(times.begin(), times.end());
+
+		print(fmt::format("{:<40} {:>10.3f} ns/voxel {:>8.2f} GB/s  (±{:.1f} %)", name, res.median_ns / double(voxels),
+						  double(bytes) / res.median_ns, 100.0 * res.mad_ns / res.median_ns));
+		results.push_back(res);
+	}
+	catch (const std::exception &e)
+	{
+		print(fmt::format("{:<40} skipped: {}", name, e.what()));
+	}
+}
+
+// Smooth structure with noise, so filters and compressors see realistic data
+template <typename T>
+i3d::Image3d<T> make_volume(std::size_t w, std::size_t h, std::size_t d)
+{
+	i3d::Image3d<T> img;
+	img.MakeRoom(w, h, d);
+
+	std::uint32_t state = 12345;
+	double top = std::is_floating_point_v<T> ? 1.0 : double(std::numeric_limits<T>::max());
+	for (std::size_t z = 0; z < d; ++z)
+		for (std::size_t y = 0; y < h; ++y)
+			for (std::size_t x = 0; x < w; ++x)
+			{
+				state = state * 1664525u + 1013904223u;
+				double noise = double(state >> 8) / double(1u << 24);
+				double wave = 0.5 + 0.3 * std::sin(0.1 * double(x + 2 * y)) * std::cos(0.07 * double(z));
+				img.SetVoxel(x, y, z, T(top * std::min(1.0, std::max(0.0, wave + 0.2 * (noise - 0.5)))));
+			}
+
+	return img;
+}
+
+template <typename T>
+const char *type_name()
+{
+	if constexpr (std::is_same_v<T, i3d::GRAY8>)
+		return "uint8";
+	else if constexpr (std::is_same_v<T, i3d::GRAY16>)
+		return "uint16";
+	else if constexpr (std::is_same_v<T, float>)
+		return "float";
+	else
+		return "double";
+}
+
+void bench_slices(std::vector<result> &results)
+{
+	auto img = make_volume<float>(po_size, po_size, po_size);
+	std::size_t voxels = img.GetImageSize(), bytes = 2 * voxels * sizeof(float);
+	std::vector<i3d::Image3d<float>> slices;
+
+	measure(results, "gather_X", voxels, bytes, [&]
+			{ slices = slices::get_X(img, 0, po_size); });
+	measure(results, "scatter_X", voxels, bytes, [&]
+			{ slices::set_X(img, slices, 0, po_size); });
+	measure(results, "gather_Y", voxels, bytes, [&]
+			{ slices = slices::get_Y(img, 0, po_size); });
+	measure(results, "scatter_Y", voxels, bytes, [&]
+			{ slices::set_Y(img, slices, 0, po_size); });
+	measure(results, "gather_Z", voxels, bytes, [&]
+			{ slices = slices::get_Z(img, 0, po_size); });
+	measure(results, "scatter_Z", voxels, bytes, [&]
+			{ slices::set_Z(img, slices, 0, po_size); });
+}
+
+void bench_copy(std::vector<result> &results)
+{
+	using types = std::tuple<i3d::GRAY8, i3d::GRAY16, float, double>;
+
+	auto from = [&](auto in)
+	{
+		using in_t = decltype(in);
+		auto src = make_volume<in_t>(po_size, po_size, po_size);
+
+		auto to = [&](auto out)
+		{
+			using out_t = decltype(out);
+			i3d::Image3d<out_t> dest;
+			measure(results, fmt::format("copy_{}_to_{}", type_name<in_t>(), type_name<out_t>()), src.GetImageSize(),
+					src.GetImageSize() * (sizeof(in_t) + sizeof(out_t)), [&]
+					{ copy(dest, src); });
+		};
+		std::apply([&](auto... out)
+				   { (to(out), ...); },
+				   types{});
+	};
+	std::apply([&](auto... in)
+			   { (from(in), ...); },
+			   types{});
+}
+
+// One CED step of a single 2D slice, i3d and native
+void bench_ced(std::vector<result> &results)
+{
+	constexpr double tau = 0.05;
+	const std::pair<double, double> smoothing[] = {{0.1, 1.0}, {1.0, 4.0}};
+
+	for (std::size_t edge : {128ul, 512ul, 1024ul})
+	{
+		auto slice = make_volume<float>(edge, edge, 1);
+		std::size_t voxels = slice.GetImageSize(), bytes = 2 * voxels * sizeof(float);
+
+		for (auto [sigma, rho] : smoothing)
+		{
+			std::string params = fmt::format("{}x{}_s{}_r{}", edge, edge, sigma, rho);
+
+			measure(results, "ced_aos_" + params, voxels, bytes, [&]
+					{ i3d::CED_AOS(slice, float(sigma), float(rho), float(tau), 1ul); });
+
+			ced::CEDSolver2D<float> solver(edge, edge, float(sigma), float(rho), float(tau));
+			measure(results, "ced_native_" + params, voxels, bytes, [&]
+					{ solver.Step(slice); });
+		}
+	}
+}
+
+// Writing and reading the volume in every format, i3d formats and the parallel readers / writers
+void bench_io(std::vector<result> &results)
+{
+	auto img = make_volume<i3d::GRAY16>(po_size, po_size, po_size);
+	std::size_t voxels = img.GetImageSize(), bytes = voxels * sizeof(i3d::GRAY16);
+	auto dir = std::filesystem::temp_directory_path() / "ced3dsplit_bench";
+	std::filesystem::create_directories(dir);
+
+	auto sequential = [](std::size_t count, auto &&fn)
+	{
+		for (std::size_t i = 0; i < count; ++i)
+			fn(i);
+	};
+
+	for (const char *ext : {"tif", "mhd", "ics", "i3d"})
+	{
+		std::string path = (dir / fmt::format("volume.{}", ext)).string();
+		measure(results, fmt::format("save_i3d_{}", ext), voxels, bytes, [&]
+				{ img.SaveImage(path.c_str()); });
+		measure(results, fmt::format("read_i3d_{}", ext), voxels, bytes, [&]
+				{ i3d::Image3d<i3d::GRAY16> in(path.c_str()); });
+	}
+
+	// readers make their input on the warm-up run if its writer was filtered out
+	auto ensure = [](const std::string &path, auto &&write)
+	{
+		if (!std::filesystem::exists(path))
+			write();
+	};
+
+	std::string tiff = (dir / "tiled.tif").string();
+	i3d::Image3d<float> work;
+	measure(results, "save_tiff_io", voxels, bytes, [&]
+			{ tiff_io::write(tiff.c_str(), img, nullptr, 6, sequential); });
+	measure(results, "read_tiff_io", voxels, bytes, [&]
+			{
+				ensure(tiff, [&]
+					   { tiff_io::write(tiff.c_str(), img, nullptr, 6, sequential); });
+				tiff_io::read(tiff.c_str(), work);
+			});
+
+	std::string zarr = (dir / "volume.zarr").string();
+	measure(results, "save_zarr_io", voxels, bytes, [&]
+			{ zarr_io::write(zarr, img, nullptr, 6, sequential); });
+	measure(results, "read_zarr_io", voxels, bytes, [&]
+			{
+				ensure(zarr, [&]
+					   { zarr_io::write(zarr, img, nullptr, 6, sequential); });
+				zarr_io::read(zarr, work, nullptr, sequential);
+			});
+
+	std::string mhd = (dir / "volume.mhd").string();
+	measure(results, "read_metaio_io", voxels, bytes, [&]
+			{
+				ensure(mhd, [&]
+					   { img.SaveImage(mhd.c_str(), i3d::IMG_METAIO, false); });
+				metaio_io::read(mhd, work, nullptr, sequential);
+			});
+
+	std::error_code error;
+	std::filesystem::remove_all(dir, error);
+}
+
+void write_json(const std::vector<result> &results)
+{
+	std::ofstream out(po_output_file);
+	out << "{\n  \"size\": " << po_size << ",\n  \"repetitions\": " << po_repetitions << ",\n  \"benchmarks\": [";
+
+	for (std::size_t i = 0; i < results.size(); ++i)
+	{
+		const result &r = results[i];
+		out << (i == 0 ? "\n" : ",\n")
+			<< fmt::format("    {{\"name\": \"{}\", \"voxels\": {}, \"bytes\": {}, \"median_ns\": {:.1f}, "
+						   "\"mad_ns\": {:.1f}, \"min_ns\": {:.1f}, \"ns_per_voxel\": {:.4f}, \"gb_per_s\": {:.3f}}}",
+						   r.name, r.voxels, r.bytes, r.median_ns, r.mad_ns, r.min_ns,
+						   r.median_ns / double(r.voxels), double(r.bytes) / r.median_ns);
+	}
+
+	out << "\n  ]\n}\n";
+	if (!out)
+		throw std::runtime_error("Cannot write " + po_output_file);
+}
+
+int main(int argc, const char **argv)
+{
+	parse_args(argc, argv);
+
+	std::vector<result> results;
+	bench_slices(results);
+	bench_copy(results);
+	bench_ced(results);
+	bench_io(results);
+
+	if (!po_output_file.empty())
+		write_json(results);
+}
@@ -0,0 +1,393 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+#include <i3d/image3d.h>
+
+#include "gauss.hpp"
+#include "tensor.hpp"
+#include "tridiag.hpp"
+
+/*
+ * Native 2D coherence-enhancing diffusion (Weickert) with the semi-implicit AOS scheme.
+ *
+ * The diagonal part of the diffusion tensor is handled implicitly (one tridiagonal
+ * system per row and per column, solved in SIMD batches by 'tridiag'),
+ * the mixed derivatives are evaluated explicitly.
+ */
+namespace ced
+{
+    // Diffusivity across the structures
+    template <typename T>
+    constexpr T alpha = T(0.001);
+
+    // Coherence threshold of the diffusivity along the structures
+    template <typename T>
+    constexpr T contrast = T(1.0);
+
+    /*
+     * f = u + tau * (d_x(b d_y u) + d_y(b d_x u)), reflecting boundary.
+     * 'S' interleaved buffers are processed at once, value (x, y) of buffer 's' is at [(y * w + x) * S + s].
+     * Only rows [first_row, last_row) of 'f' are written.
+     */
+    template <typename T, std::size_t S = 1>
+    void mixed_term(const T *u, const T *b, T *f, std::size_t w, std::size_t h, T tau,
+                    std::size_t first_row, std::size_t last_row)
+    {
+        for (std::size_t y = first_row; y < last_row; ++y)
+        {
+            std::size_t ym = y > 0 ? y - 1 : 0;
+            std::size_t yp = y + 1 < h ? y + 1 : h - 1;
+
+            for (std::size_t x = 0; x < w; ++x)
+            {
+                std::size_t xm = x > 0 ? x - 1 : 0;
+                std::size_t xp = x + 1 < w ? x + 1 : w - 1;
+
+                auto at = [w](std::size_t x, std::size_t y)
+                { return (y * w + x) * S; };
+
+                for (std::size_t s = 0; s < S; ++s)
+                {
+                    T dxy = b[at(xp, y) + s] * (u[at(xp, yp) + s] - u[at(xp, ym) + s]) -
+                            b[at(xm, y) + s] * (u[at(xm, yp) + s] - u[at(xm, ym) + s]);
+                    T dyx = b[at(x, yp) + s] * (u[at(xp, yp) + s] - u[at(xm, yp) + s]) -
+                            b[at(x, ym) + s] * (u[at(xp, ym) + s] - u[at(xm, ym) + s]);
+
+                    f[at(x, y) + s] = u[at(x, y) + s] + tau * T(0.25) * (dxy + dyx);
+                }
+            }
+        }
+    }
+
+    template <typename T, std::size_t S = 1>
+    void mixed_term(const T *u, const T *b, T *f, std::size_t w, std::size_t h, T tau)
+    {
+        mixed_term<T, S>(u, b, f, w, h, tau, 0, h);
+    }
+
+    // When a cached diffusion tensor is recomputed
+    struct refresh_policy
+    {
+        // Every 'every' steps (0 means only on change, 1 means always, the cache is not used)
+        std::size_t every = 1;
+        // Earlier once the RMS change of the input since the last recomputation exceeds this (0 means never)
+        double threshold = 0.0;
+
+        bool caching() const { return every != 1; }
+    };
+
+    /*
+     * Diffusion tensor of one slice (or one batch of interleaved slices) kept across steps,
+     * the planes a, b, c of 'count' values each, followed by the input at the last
+     * recomputation when the policy is adaptive.
+     */
+    template <typename PREC>
+    class cached_tensor
+    {
+    public:
+        /*
+         * Tensor storage for the next step of 'u', 'refresh' is set when the solver has to
+         * recompute it. The storage is set up on first use and whenever 'count' changes.
+         */
+        PREC *get(const PREC *u, std::size_t count, const refresh_policy &policy, bool &refresh)
+        {
+            bool adaptive = policy.threshold > 0.0;
+            std::size_t size = (adaptive ? 4 : 3) * count;
+            if (m_planes.size() != size)
+            {
+                m_planes.assign(size, PREC(0));
+                m_age = 0;
+            }
+
+            refresh = m_age == 0 || (policy.every != 0 && m_age >= policy.every) ||
+                      (adaptive && rms_change(u, count) > policy.threshold);
+            if (refresh)
+            {
+                m_age = 0;
+                if (adaptive)
+                    std::copy(u, u + count, m_planes.data() + 3 * count);
+            }
+
+            ++m_age;
+            ++m_steps;
+            m_refreshes += refresh;
+            return m_planes.data();
+        }
+
+        std::size_t bytes() const { return m_planes.size() * sizeof(PREC); }
+
+        // Steps served and recomputations among them
+        std::size_t steps() const { return m_steps; }
+        std::size_t refreshes() const { return m_refreshes; }
+
+    private:
+        double rms_change(const PREC *u, std::size_t count) const
+        {
+            const PREC *before = m_planes.data() + 3 * count;
+            double sum = 0.0;
+            for (std::size_t i = 0; i < count; ++i)
+                sum += double(u[i] - before[i]) * double(u[i] - before[i]);
+            return std::sqrt(sum / double(std::max<std::size_t>(count, 1)));
+        }
+
+        std::vector<PREC> m_planes;
+        std::size_t m_age = 0, m_steps = 0, m_refreshes = 0;
+    };
+
+    /*
+     * Reusable CED stepper for 2D slices up to a given size. Gaussian filters and all
+     * temporaries are set up once in the constructor, 'Step' does not allocate.
+     *
+     * A step can be split into 'parts' tasks per stage (rows, columns or ranges of pixels),
+     * run by a caller supplied 'parallel_for(count, fn)'. Every part has its own scratch buffer.
+     */
+    template <typename PREC>
+    class CEDSolver2D
+    {
+    public:
+        CEDSolver2D(std::size_t max_width, std::size_t max_height,
+                    PREC sigma, PREC rho, PREC tau,
+                    gauss::backend smoothing = gauss::backend::fir,
+                    std::size_t parts = 1)
+            : m_max_width(max_width), m_max_height(max_height), m_parts(std::max<std::size_t>(parts, 1)),
+              m_tau(tau), m_sigma(smoothing, sigma), m_rho(smoothing, rho)
+        {
+            std::size_t count = max_width * max_height;
+            std::size_t line = std::max(max_width, max_height);
+
+            m_smooth.resize(count);
+            m_a.resize(count);
+            m_b.resize(count);
+            m_c.resize(count);
+            m_f.resize(count);
+            m_part_buffer = std::max(gauss::workspace<PREC>(line, line), 4 * line * simd::lanes<PREC>);
+            m_buffer.resize(m_parts * m_part_buffer);
+        }
+
+        // One CED iteration of the w x h row-major buffer 'u' in place
+        void Step(PREC *u, std::size_t w, std::size_t h)
+        {
+            Step(u, w, h, [](std::size_t count, auto &&fn)
+                 {
+                     for (std::size_t i = 0; i < count; ++i)
+                         fn(i);
+                 });
+        }
+
+        // 'Step' with every stage split into 'parts' tasks run by 'parallel_for'
+        template <typename F>
+        void Step(PREC *u, std::size_t w, std::size_t h, F &&parallel_for)
+        {
+            Step(u, w, h, nullptr, true, parallel_for);
+        }
+
+        /*
+         * 'Step' with the diffusion tensor in 'cached' (3 * w * h values, see 'cached_tensor'),
+         * it is recomputed if 'refresh' is set, otherwise the stored one is used and the sigma
+         * and rho smoothing are skipped. Without 'cached' the solver's own buffers are used.
+         */
+        template <typename F>
+        void Step(PREC *u, std::size_t w, std::size_t h, PREC *cached, bool refresh, F &&parallel_for)
+        {
+            if (w * h > m_smooth.size() || std::max(w, h) > std::max(m_max_width, m_max_height))
+                throw std::invalid_argument("Slice is larger than the solver was built for");
+
+            constexpr std::size_t L = simd::lanes<PREC>;
+            std::size_t count = w * h;
+            PREC *smooth = m_smooth.data();
+            PREC *a = cached ? cached : m_a.data();
+            PREC *b = cached ? cached + count : m_b.data();
+            PREC *c = cached ? cached + 2 * count : m_c.data();
+            PREC *f = m_f.data();
+
+            // Runs 'fn(first, last, buffer)' on 'parts' ranges of [0, n), split at multiples of 'granularity'
+            auto split = [&](std::size_t n, std::size_t granularity, auto &&fn)
+            {
+                std::size_t blocks = (n + granularity - 1) / granularity;
+                parallel_for(m_parts, [&](std::size_t p)
+                             {
+                                 std::size_t first = std::min(n, blocks * p / m_parts * granularity);
+                                 std::size_t last = std::min(n, blocks * (p + 1) / m_parts * granularity);
+                                 if (first < last)
+                                     fn(first, last, m_buffer.data() + p * m_part_buffer);
+                             });
+            };
+
+            auto smooth_buffer = [&](const gauss::filter<PREC> &filter, PREC *data)
+            {
+                split(h, L, [&](std::size_t first, std::size_t last, PREC *buffer)
+                      { filter.apply_rows(data, w, h, first, last, buffer); });
+                split(w, L, [&](std::size_t first, std::size_t last, PREC *buffer)
+                      { filter.apply_columns(data, w, h, first, last, buffer); });
+            };
+
+            if (!cached || refresh)
+            {
+                std::copy(u, u + count, smooth);
+                smooth_buffer(m_sigma, smooth);
+
+                split(h, 1, [&](std::size_t first, std::size_t last, PREC *)
+                      { tensor::structure_tensor(smooth, a, b, c, w, h, first, last); });
+                smooth_buffer(m_rho, a);
+                smooth_buffer(m_rho, b);
+                smooth_buffer(m_rho, c);
+
+                split(count, L, [&](std::size_t first, std::size_t last, PREC *)
+                      { tensor::diffusion_tensor(a + first, b + first, c + first, last - first, alpha<PREC>, contrast<PREC>); });
+            }
+            split(h, 1, [&](std::size_t first, std::size_t last, PREC *)
+                  { mixed_term(u, b, f, w, h, m_tau, first, last); });
+
+            // AOS: u = 1/2 * sum over axes of (I - 2 tau A_l)^-1 f
+            std::fill(u, u + count, PREC(0));
+            split(h, L, [&](std::size_t first, std::size_t last, PREC *buffer)
+                  { tridiag::diffuse_lines(f + first * w, a + first * w, u + first * w, w, last - first, 1, w,
+                                           PREC(2) * m_tau, PREC(0.5), buffer); });
+            split(w, L, [&](std::size_t first, std::size_t last, PREC *buffer)
+                  { tridiag::diffuse_lines(f + first, c + first, u + first, h, last - first, w, 1,
+                                           PREC(2) * m_tau, PREC(0.5), buffer); });
+        }
+
+        // One CED iteration of a 2D image (size z == 1)
+        void Step(i3d::Image3d<PREC> &slice)
+        {
+            if (slice.GetSizeZ() != 1)
+                throw std::invalid_argument("Native CED supports only 2D images");
+
+            Step(slice.GetFirstVoxelAddr(), slice.GetSizeX(), slice.GetSizeY());
+        }
+
+        template <typename F>
+        void Step(i3d::Image3d<PREC> &slice, F &&parallel_for)
+        {
+            if (slice.GetSizeZ() != 1)
+                throw std::invalid_argument("Native CED supports only 2D images");
+
+            Step(slice.GetFirstVoxelAddr(), slice.GetSizeX(), slice.GetSizeY(), parallel_for);
+        }
+
+        void Step(i3d::Image3d<PREC> &slice, PREC *cached, bool refresh)
+        {
+            Step(slice, cached, refresh, [](std::size_t count, auto &&fn)
+                 {
+                     for (std::size_t i = 0; i < count; ++i)
+                         fn(i);
+                 });
+        }
+
+        template <typename F>
+        void Step(i3d::Image3d<PREC> &slice, PREC *cached, bool refresh, F &&parallel_for)
+        {
+            if (slice.GetSizeZ() != 1)
+                throw std::invalid_argument("Native CED supports only 2D images");
+
+            Step(slice.GetFirstVoxelAddr(), slice.GetSizeX(), slice.GetSizeY(), cached, refresh, parallel_for);
+        }
+
+    private:
+        std::size_t m_max_width, m_max_height, m_parts, m_part_buffer;
+        PREC m_tau;
+        gauss::filter<PREC> m_sigma, m_rho;
+        std::vector<PREC> m_smooth, m_a, m_b, m_c, m_f, m_buffer;
+    };
+
+    /*
+     * 'CEDSolver2D' that advances 'lanes' slices of the same size at once. The slices are
+     * interleaved, value (x, y) of slice 's' is stored at [(y * w + x) * lanes + s], and every
+     * stage runs its SIMD lanes across the slices, so even short rows vectorise fully.
+     * The results equal 'CEDSolver2D' applied to each slice.
+     */
+    template <typename PREC>
+    class CEDBatchSolver2D
+    {
+    public:
+        static constexpr std::size_t lanes = simd::lanes<PREC>;
+
+        CEDBatchSolver2D(std::size_t max_width, std::size_t max_height,
+                         PREC sigma, PREC rho, PREC tau,
+                         gauss::backend smoothing = gauss::backend::fir)
+            : m_max_width(max_width), m_max_height(max_height), m_tau(tau),
+              m_sigma(smoothing, sigma), m_rho(smoothing, rho)
+        {
+            std::size_t count = max_width * max_height * lanes;
+            std::size_t line = std::max(max_width, max_height);
+
+            m_smooth.resize(count);
+            m_a.resize(count);
+            m_b.resize(count);
+            m_c.resize(count);
+            m_f.resize(count);
+            m_buffer.resize(std::max(gauss::workspace<PREC>(line, line), 4 * line * lanes));
+        }
+
+        // Bytes of memory held by a solver for w x h slices (excluding the slices)
+        static std::size_t footprint(std::size_t w, std::size_t h)
+        {
+            return (5 * w * h + 4 * std::max(w, h)) * lanes * sizeof(PREC);
+        }
+
+        // One CED iteration of 'lanes' interleaved w x h slices in place
+        void Step(PREC *u, std::size_t w, std::size_t h)
+        {
+            Step(u, w, h, nullptr, true);
+        }
+
+        // 'Step' with a stored diffusion tensor of 3 * w * h * lanes values, as in 'CEDSolver2D'
+        void Step(PREC *u, std::size_t w, std::size_t h, PREC *cached, bool refresh)
+        {
+            if (w * h * lanes > m_smooth.size() || std::max(w, h) > std::max(m_max_width, m_max_height))
+                throw std::invalid_argument("Slice is larger than the solver was built for");
+
+            std::size_t count = w * h * lanes;
+            PREC *smooth = m_smooth.data();
+            PREC *a = cached ? cached : m_a.data();
+            PREC *b = cached ? cached + count : m_b.data();
+            PREC *c = cached ? cached + 2 * count : m_c.data();
+            PREC *f = m_f.data();
+            PREC *buffer = m_buffer.data();
+
+            if (!cached || refresh)
+            {
+                std::copy(u, u + count, smooth);
+                m_sigma.apply_interleaved(smooth, w, h, buffer);
+
+                tensor::structure_tensor_interleaved(smooth, a, b, c, w, h);
+                m_rho.apply_interleaved(a, w, h, buffer);
+                m_rho.apply_interleaved(b, w, h, buffer);
+                m_rho.apply_interleaved(c, w, h, buffer);
+
+                tensor::diffusion_tensor(a, b, c, count, alpha<PREC>, contrast<PREC>);
+            }
+            mixed_term<PREC, lanes>(u, b, f, w, h, m_tau);
+
+            std::fill(u, u + count, PREC(0));
+            tridiag::diffuse_interleaved(f, a, u, w, h, lanes, w * lanes, PREC(2) * m_tau, PREC(0.5), buffer);
+            tridiag::diffuse_interleaved(f, c, u, h, w, w * lanes, lanes, PREC(2) * m_tau, PREC(0.5), buffer);
+        }
+
+    private:
+        std::size_t m_max_width, m_max_height;
+        PREC m_tau;
+        gauss::filter<PREC> m_sigma, m_rho;
+        std::vector<PREC> m_smooth, m_a, m_b, m_c, m_f, m_buffer;
+    };
+
+    /*
+     * Drop-in replacement of i3d::CED_AOS for 2D images (size z == 1),
+     * 'smoothing' selects the Gaussian used for the sigma and rho smoothing.
+     */
+    template <typename T>
+    void ced_aos(i3d::Image3d<T> &img, T sigma, T rho, T tau, std::size_t num_iter,
+                 gauss::backend smoothing = gauss::backend::fir)
+    {
+        CEDSolver2D<T> solver(img.GetSizeX(), img.GetSizeY(), sigma, rho, tau, smoothing);
+
+        for (std::size_t it = 0; it < num_iter; ++it)
+            solver.Step(img);
+    }
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+#include <zlib.h>
+
+/*
+ * zlib (RFC 1950) streams, the format of TIFF "Adobe deflate", the HDF5 deflate filter
+ * and the Zarr zlib compressor, so chunks compressed here can be stored as-is in all three.
+ */
+namespace codec
+{
+    // 'size' bytes at 'data' compressed at 'level' (1 - 9)
+    inline std::vector<unsigned char> compress(const void *data, std::size_t size, int level)
+    {
+        uLongf packed = compressBound(uLong(size));
+        std::vector<unsigned char> out(packed);
+
+        if (compress2(out.data(), &packed, static_cast<const Bytef *>(data), uLong(size), level) != Z_OK)
+            throw std::runtime_error("Deflate compression failed");
+
+        out.resize(packed);
+        return out;
+    }
+
+    // Inflates 'data' into exactly 'size' bytes at 'out'
+    inline void decompress(const void *data, std::size_t data_size, void *out, std::size_t size)
+    {
+        uLongf unpacked = uLongf(size);
+        if (uncompress(static_cast<Bytef *>(out), &unpacked, static_cast<const Bytef *>(data), uLong(data_size)) != Z_OK ||
+            unpacked != size)
+            throw std::runtime_error("Deflate decompression failed");
+    }
+}
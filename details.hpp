@@ -8,6 +8,23 @@ void print(const std::string &s)
 
 namespace slices
 {
+    // Width and height of the slices perpendicular to the given axis
+    template <typename img_t>
+    std::pair<std::size_t, std::size_t> slice_size(const i3d::Image3d<img_t> &img, std::size_t axis)
+    {
+        switch (axis)
+        {
+        case 0:
+            return {img.GetSizeY(), img.GetSizeZ()};
+        case 1:
+            return {img.GetSizeX(), img.GetSizeZ()};
+        case 2:
+            return {img.GetSizeX(), img.GetSizeY()};
+        }
+
+        throw std::out_of_range("Axis out of range");
+    }
+
     template <typename img_t>
     std::vector<i3d::Image3d<img_t>> get_X(const i3d::Image3d<img_t> &img, std::size_t start_idx, std::size_t end_idx)
     {
@@ -119,4 +136,114 @@ namespace slices
                     img.SetVoxel(x, y, i, slices[i - start_idx].GetVoxel(x, y, 0));
     }
 
-}
\ No newline at end of file
+    // Strides of voxel (x, y, z) split into slice index and in-slice (u, v) coordinates of the given axis
+    template <typename img_t>
+    std::array<std::size_t, 3> interleaved_strides(const i3d::Image3d<img_t> &img, std::size_t axis)
+    {
+        std::size_t sx = 1, sy = img.GetSizeX(), sz = img.GetSizeX() * img.GetSizeY();
+        switch (axis)
+        {
+        case 0:
+            return {sx, sy, sz};
+        case 1:
+            return {sy, sx, sz};
+        case 2:
+            return {sz, sx, sy};
+        }
+
+        throw std::out_of_range("Axis out of range");
+    }
+
+    /*
+     * Gathers the width x height rectangle at (u0, v0) of 'count' <= 'lanes' slices starting at
+     * 'start_idx' into 'out', interleaved so that value (u, v) of slice s is stored at
+     * [(v * width + u) * lanes + s]. Missing lanes are zeroed.
+     */
+    template <typename img_t>
+    void get_interleaved(const i3d::Image3d<img_t> &img,
+                         std::size_t start_idx, std::size_t count, std::size_t axis, std::size_t lanes,
+                         std::size_t u0, std::size_t v0, std::size_t width, std::size_t height,
+                         img_t *out)
+    {
+        auto [s_idx, s_u, s_v] = interleaved_strides(img, axis);
+        const img_t *data = img.GetFirstVoxelAddr();
+
+        for (std::size_t v = 0; v < height; ++v)
+            for (std::size_t u = 0; u < width; ++u)
+            {
+                const img_t *src = data + start_idx * s_idx + (u0 + u) * s_u + (v0 + v) * s_v;
+                img_t *dst = out + (v * width + u) * lanes;
+                for (std::size_t s = 0; s < lanes; ++s)
+                    dst[s] = s < count ? src[s * s_idx] : img_t(0);
+            }
+    }
+
+    template <typename img_t>
+    void set_interleaved(i3d::Image3d<img_t> &img,
+                         const img_t *in,
+                         std::size_t start_idx, std::size_t count, std::size_t axis, std::size_t lanes,
+                         std::size_t u0, std::size_t v0, std::size_t width, std::size_t height)
+    {
+        auto [s_idx, s_u, s_v] = interleaved_strides(img, axis);
+        img_t *data = img.GetFirstVoxelAddr();
+
+        for (std::size_t v = 0; v < height; ++v)
+            for (std::size_t u = 0; u < width; ++u)
+            {
+                img_t *dst = data + start_idx * s_idx + (u0 + u) * s_u + (v0 + v) * s_v;
+                const img_t *src = in + (v * width + u) * lanes;
+                for (std::size_t s = 0; s < count; ++s)
+                    dst[s * s_idx] = src[s];
+            }
+    }
+
+    // Copies the width x height rectangle at (u0, v0) of a 2D slice into 'out'
+    template <typename img_t>
+    void crop(const i3d::Image3d<img_t> &slice, i3d::Image3d<img_t> &out,
+              std::size_t u0, std::size_t v0, std::size_t width, std::size_t height)
+    {
+        out.MakeRoom(width, height, 1);
+        for (std::size_t v = 0; v < height; ++v)
+            std::copy_n(slice.GetFirstVoxelAddr() + (v0 + v) * slice.GetSizeX() + u0, width,
+                        out.GetFirstVoxelAddr() + v * width);
+    }
+
+    // Inverse of 'crop'
+    template <typename img_t>
+    void paste(i3d::Image3d<img_t> &slice, const i3d::Image3d<img_t> &part, std::size_t u0, std::size_t v0)
+    {
+        for (std::size_t v = 0; v < part.GetSizeY(); ++v)
+            std::copy_n(part.GetFirstVoxelAddr() + v * part.GetSizeX(), part.GetSizeX(),
+                        slice.GetFirstVoxelAddr() + (v0 + v) * slice.GetSizeX() + u0);
+    }
+}
+
+template <typename in_t, typename out_t>
+void copy(i3d::Image3d<out_t> &dest, const i3d::Image3d<in_t> &src)
+{
+    dest.MakeRoom(src.GetSize());
+    for (std::size_t x = 0; x < src.GetSizeX(); ++x)
+        for (std::size_t y = 0; y < src.GetSizeY(); ++y)
+            for (std::size_t z = 0; z < src.GetSizeZ(); ++z)
+                dest.SetVoxel(
+                    x, y, z,
+                    out_t(std::min<double>(
+                        std::max<double>(src.GetVoxel(x, y, z),
+                                         std::numeric_limits<out_t>::lowest()),
+                        std::numeric_limits<out_t>::max())));
+}
+
+// 'src' as an 'out_t' image: 'src' itself if the types match, otherwise its copy in 'dest'
+template <typename out_t, typename in_t>
+const i3d::Image3d<out_t> &as_type(i3d::Image3d<out_t> &dest, const i3d::Image3d<in_t> &src)
+{
+    if constexpr (std::is_same_v<out_t, in_t>)
+        return src;
+    else
+    {
+        copy(dest, src);
+        dest.SetResolution(src.GetResolution());
+        dest.SetOffset(src.GetOffset());
+        return dest;
+    }
+}
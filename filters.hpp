@@ -0,0 +1,294 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <i3d/diffusion_filters.h>
+#include <i3d/image3d.h>
+
+#include "ced.hpp"
+#include "gauss.hpp"
+#include "nonlinear.hpp"
+
+/*
+ * Per-slice filters of the split driver. A filter advances one 2D slice by one iteration,
+ * the driver runs it on the slices of every axis in turn, in parallel, with one instance
+ * per thread, so instances may keep scratch memory but must not share it.
+ *
+ * Beyond 'Step' a filter may offer to split one slice across the pool ('splits'), to step
+ * interleaved batches of small slices ('batch_lanes') and to keep state of every slice across
+ * iterations in a driver owned 'slice_cache' ('caches'). The driver uses what is offered.
+ *
+ * New filters register a factory in 'registry()' under the name given to --filter and the
+ * --backend they implement.
+ */
+namespace filters
+{
+    // Parameters of a run, in voxels of the grid it runs on, every filter uses the ones it needs
+    struct params
+    {
+        double sigma, rho, tau, lambda;
+        gauss::backend smoothing = gauss::backend::fir;
+        // Diffusion tensor caching of the native CED backend
+        ced::refresh_policy refresh;
+    };
+
+    // State a filter keeps for one slice (or one batch) across iterations
+    template <typename PREC>
+    using slice_cache = ced::cached_tensor<PREC>;
+
+    // A slice step split into 'parts' tasks, run by 'parallel_for(count, fn)' on the driver's pool
+    struct pool_split
+    {
+        std::size_t parts = 1;
+        std::function<void(std::size_t, const std::function<void(std::size_t)> &)> parallel_for;
+    };
+
+    template <typename PREC>
+    class slice_filter
+    {
+    public:
+        virtual ~slice_filter() = default;
+
+        // One iteration of a 2D slice (size z == 1) in place
+        virtual void Step(i3d::Image3d<PREC> &slice) = 0;
+
+        // 'Step' with the 'cache' of this slice and split by 'split', either may be null
+        virtual void StepWith(i3d::Image3d<PREC> &slice, slice_cache<PREC> *, const pool_split *) { Step(slice); }
+
+        // Whether 'StepWith' uses a cache / can split a slice
+        virtual bool caches() const { return false; }
+        virtual bool splits() const { return false; }
+
+        // Slices of w x h 'StepBatch' advances at once, 0 if it does not batch them
+        virtual std::size_t batch_lanes(std::size_t, std::size_t) const { return 0; }
+
+        // One iteration of 'batch_lanes(w, h)' interleaved w x h slices in place (see ced.hpp)
+        virtual void StepBatch(PREC *, std::size_t, std::size_t, slice_cache<PREC> *)
+        {
+            throw std::logic_error("Filter does not step batches");
+        }
+    };
+
+    // i3d::CED_AOS, coherence-enhancing diffusion
+    template <typename PREC>
+    class ced_i3d : public slice_filter<PREC>
+    {
+    public:
+        explicit ced_i3d(const params &p) : m_params(p) {}
+
+        void Step(i3d::Image3d<PREC> &slice) override
+        {
+            i3d::CED_AOS(slice, PREC(m_params.sigma), PREC(m_params.rho), PREC(m_params.tau), 1ul);
+        }
+
+    private:
+        params m_params;
+    };
+
+    /*
+     * Native coherence-enhancing diffusion (ced.hpp). Splits slices across the pool, steps small
+     * slices in interleaved SIMD batches and, with 'params::refresh', keeps diffusion tensors
+     * across iterations. Solvers for split and batched steps are set up on first use.
+     */
+    template <typename PREC>
+    class ced_native : public slice_filter<PREC>
+    {
+    public:
+        using batch_solver_t = ced::CEDBatchSolver2D<PREC>;
+
+        // Larger batches step slice by slice, such slices fill the SIMD lanes and stay cache resident
+        static constexpr std::size_t batch_footprint_limit = 16ul << 20;
+
+        ced_native(std::size_t max_width, std::size_t max_height, const params &p)
+            : m_params(p), m_max_width(max_width), m_max_height(max_height),
+              m_solver(std::in_place, max_width, max_height, PREC(p.sigma), PREC(p.rho), PREC(p.tau), p.smoothing)
+        {
+        }
+
+        void Step(i3d::Image3d<PREC> &slice) override { m_solver->Step(slice); }
+
+        void StepWith(i3d::Image3d<PREC> &slice, slice_cache<PREC> *cache, const pool_split *split) override
+        {
+            bool refresh = true;
+            PREC *tensor = cache ? cache->get(slice.GetFirstVoxelAddr(), slice.GetImageSize(), m_params.refresh, refresh)
+                                 : nullptr;
+            if (!split)
+            {
+                m_solver->Step(slice, tensor, refresh);
+                return;
+            }
+
+            if (split->parts > m_parts)
+            {
+                m_parts = split->parts;
+                m_solver.emplace(m_max_width, m_max_height, PREC(m_params.sigma), PREC(m_params.rho),
+                                 PREC(m_params.tau), m_params.smoothing, m_parts);
+            }
+            m_solver->Step(slice, tensor, refresh, split->parallel_for);
+        }
+
+        bool caches() const override { return m_params.refresh.caching(); }
+        bool splits() const override { return true; }
+
+        std::size_t batch_lanes(std::size_t w, std::size_t h) const override
+        {
+            return batch_solver_t::footprint(w, h) <= batch_footprint_limit ? batch_solver_t::lanes : 0;
+        }
+
+        void StepBatch(PREC *u, std::size_t w, std::size_t h, slice_cache<PREC> *cache) override
+        {
+            if (!m_batch_solver || w > m_batch_width || h > m_batch_height)
+            {
+                m_batch_width = std::max(m_batch_width, w);
+                m_batch_height = std::max(m_batch_height, h);
+                m_batch_solver.emplace(m_batch_width, m_batch_height, PREC(m_params.sigma), PREC(m_params.rho),
+                                       PREC(m_params.tau), m_params.smoothing);
+            }
+
+            bool refresh = true;
+            PREC *tensor = cache ? cache->get(u, w * h * batch_solver_t::lanes, m_params.refresh, refresh) : nullptr;
+            m_batch_solver->Step(u, w, h, tensor, refresh);
+        }
+
+    private:
+        params m_params;
+        std::size_t m_max_width, m_max_height, m_parts = 1;
+        std::size_t m_batch_width = 0, m_batch_height = 0;
+        std::optional<ced::CEDSolver2D<PREC>> m_solver;
+        std::optional<batch_solver_t> m_batch_solver;
+    };
+
+    // i3d::EED_AOS, edge-enhancing diffusion, 'lambda' is the edge contrast
+    template <typename PREC>
+    class eed_i3d : public slice_filter<PREC>
+    {
+    public:
+        explicit eed_i3d(const params &p) : m_params(p) {}
+
+        void Step(i3d::Image3d<PREC> &slice) override
+        {
+            i3d::EED_AOS(slice, PREC(m_params.sigma), PREC(m_params.lambda), PREC(m_params.tau), 1ul);
+        }
+
+    private:
+        params m_params;
+    };
+
+    // i3d::Gauss_LOD, every iteration is a Gaussian of 'sigma'
+    template <typename PREC>
+    class gauss_i3d : public slice_filter<PREC>
+    {
+    public:
+        explicit gauss_i3d(const params &p) : m_params(p) {}
+
+        void Step(i3d::Image3d<PREC> &slice) override
+        {
+            i3d::Gauss_LOD(slice, PREC(m_params.sigma), 1ul);
+        }
+
+    private:
+        params m_params;
+    };
+
+    /*
+     * Perona - Malik and total variation diffusion. The i3d AOSPMFilter / AOSTVFilter classes are
+     * only instantiated for a few voxel types (AOSPMFilter for GRAY8 input alone), so these run on
+     * the native solver, which works in the precision of the run.
+     */
+    template <typename PREC>
+    class nonlinear_native : public slice_filter<PREC>
+    {
+    public:
+        nonlinear_native(nonlinear::diffusivity type, std::size_t max_width, std::size_t max_height, const params &p)
+            : m_solver(max_width, max_height, type, PREC(p.sigma), PREC(p.lambda), PREC(p.tau), p.smoothing)
+        {
+        }
+
+        void Step(i3d::Image3d<PREC> &slice) override { m_solver.Step(slice); }
+
+    private:
+        nonlinear::NonlinearSolver2D<PREC> m_solver;
+    };
+
+    // Builds a filter for slices up to max_width x max_height
+    template <typename PREC>
+    using factory = std::function<std::unique_ptr<slice_filter<PREC>>(std::size_t max_width, std::size_t max_height,
+                                                                      const params &p)>;
+
+    // 'caching' marks implementations that honour 'params::refresh'
+    template <typename PREC>
+    struct entry
+    {
+        std::string name, backend;
+        bool caching;
+        factory<PREC> make;
+    };
+
+    template <typename PREC>
+    const std::vector<entry<PREC>> &registry()
+    {
+        static const std::vector<entry<PREC>> filters = {
+            {"ced", "i3d", false, [](std::size_t, std::size_t, const params &p)
+             { return std::make_unique<ced_i3d<PREC>>(p); }},
+            {"ced", "native", true, [](std::size_t w, std::size_t h, const params &p)
+             { return std::make_unique<ced_native<PREC>>(w, h, p); }},
+            {"eed", "i3d", false, [](std::size_t, std::size_t, const params &p)
+             { return std::make_unique<eed_i3d<PREC>>(p); }},
+            {"gauss", "i3d", false, [](std::size_t, std::size_t, const params &p)
+             { return std::make_unique<gauss_i3d<PREC>>(p); }},
+            {"pm", "native", false, [](std::size_t w, std::size_t h, const params &p)
+             { return std::make_unique<nonlinear_native<PREC>>(nonlinear::diffusivity::perona_malik, w, h, p); }},
+            {"tv", "native", false, [](std::size_t w, std::size_t h, const params &p)
+             { return std::make_unique<nonlinear_native<PREC>>(nonlinear::diffusivity::total_variation, w, h, p); }},
+        };
+        return filters;
+    }
+
+    /*
+     * Implementation of filter 'name' for 'backend', a filter with a single implementation is
+     * used whatever the backend, null if there is none.
+     */
+    template <typename PREC>
+    const entry<PREC> *find(const std::string &name, const std::string &backend)
+    {
+        const entry<PREC> *found = nullptr;
+        std::size_t count = 0;
+        for (const auto &e : registry<PREC>())
+            if (e.name == name)
+            {
+                if (e.backend == backend)
+                    return &e;
+                found = &e;
+                ++count;
+            }
+
+        return count == 1 ? found : nullptr;
+    }
+
+    inline bool is_known(const std::string &name, const std::string &backend)
+    {
+        return find<float>(name, backend) != nullptr;
+    }
+
+    inline bool supports_caching(const std::string &name, const std::string &backend)
+    {
+        const entry<float> *e = find<float>(name, backend);
+        return e && e->caching;
+    }
+
+    template <typename PREC>
+    std::unique_ptr<slice_filter<PREC>> make(const std::string &name, const std::string &backend,
+                                             std::size_t max_width, std::size_t max_height, const params &p)
+    {
+        if (const entry<PREC> *e = find<PREC>(name, backend))
+            return e->make(max_width, max_height, p);
+
+        throw std::invalid_argument("Unknown filter " + name + " for backend " + backend);
+    }
+}
@@ -0,0 +1,284 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fmt/core.h>
+#include <i3d/i3dio.h>
+#include <i3d/image3d.h>
+#include <i3d/imgfiles.h>
+
+#include "hdf5_io.hpp"
+#include "tiff_io.hpp"
+#include "zarr_io.hpp"
+
+/*
+ * Multi-frame (t, c, z, y, x) input and output, one (frame, channel) volume at a time.
+ *
+ * A 'source' is an ImageJ hyperstack TIFF, an HDF5 dataset with frame and channel axes or a
+ * multi-channel ICS file. A 'sink' writes the results in the layout of the input: HDF5 as one
+ * dataset with the same axes, TIFF as a hyperstack and other formats as one file per volume.
+ * Volumes may be read and written from several threads at once, HDF5 and i3d calls are
+ * serialised by 'library_mutex'.
+ */
+namespace frames
+{
+    inline std::mutex library_mutex;
+
+    enum class format
+    {
+        tiff,
+        hdf5,
+        ics
+    };
+
+    inline bool has_ics_extension(const std::string &fname)
+    {
+        std::string ext = fname.substr(std::min(fname.size(), fname.rfind('.')));
+        std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c)
+                       { return char(std::tolower(c)); });
+        return ext == ".ics";
+    }
+
+    class source
+    {
+    public:
+        /*
+         * The frames of 'path' (HDF5 input reads 'dataset'), empty if it is a single volume for the
+         * 3D path: a TIFF that is not a hyperstack of several volumes, or a single channel ICS.
+         * HDF5 datasets are always read here, the 3D path cannot read them. The page index of a
+         * single volume TIFF is left in 'pages', so the 3D path does not index it again.
+         */
+        static std::optional<source> open(const std::string &path, const std::string &dataset,
+                                          std::vector<tiff_io::page_ref> *pages = nullptr)
+        {
+            source s;
+            s.m_path = path;
+
+            if (hdf5_io::has_dataset(path, dataset))
+            {
+                std::lock_guard<std::mutex> lock(library_mutex);
+                auto info = hdf5_io::read_info(path, dataset);
+                s.m_format = format::hdf5;
+                s.m_dataset = dataset;
+                s.m_frames = info.frames;
+                s.m_channels = info.channels;
+                s.m_channel_axis = info.rank == 5;
+                s.m_header = info.header;
+                return s;
+            }
+
+            if (tiff_io::can_stream(path))
+            {
+                auto sequential = [](std::size_t count, auto &&fn)
+                {
+                    for (std::size_t i = 0; i < count; ++i)
+                        fn(i);
+                };
+
+                s.m_pages = tiff_io::index_pages(std::vector<std::string>{path}, sequential);
+                s.m_stack = tiff_io::read_hyperstack(path, s.m_pages.size());
+                if (s.m_stack.volumes() < 2)
+                {
+                    if (pages)
+                        *pages = std::move(s.m_pages);
+                    return std::nullopt;
+                }
+
+                s.m_format = format::tiff;
+                s.m_frames = s.m_stack.frames;
+                s.m_channels = s.m_stack.channels;
+                s.m_channel_axis = s.m_channels > 1;
+                s.m_header = i3d::ReadImageHeader(path.c_str());
+                s.m_header.size.z = s.m_stack.slices;
+                return s;
+            }
+
+            if (has_ics_extension(path))
+            {
+                std::lock_guard<std::mutex> lock(library_mutex);
+                i3d::ImageReader *reader = i3d::CreateReader(path.c_str());
+                std::size_t channels = reader->GetNumChannels();
+                i3d::DestroyReader(reader);
+                if (channels < 2)
+                    return std::nullopt;
+
+                s.m_format = format::ics;
+                s.m_channels = channels;
+                s.m_channel_axis = true;
+                s.m_header = i3d::ReadImageHeader(path.c_str());
+                return s;
+            }
+
+            return std::nullopt;
+        }
+
+        format file_format() const { return m_format; }
+        std::size_t frames() const { return m_frames; }
+        std::size_t channels() const { return m_channels; }
+
+        // Whether the input has a channel axis, even of one channel, which the output keeps
+        bool channel_axis() const { return m_channel_axis; }
+
+        // Size, voxel type and resolution of one volume
+        const i3d::ImageHeader &header() const { return m_header; }
+
+        /*
+         * Reads the volume of frame 't', channel 'c' (or its 'voi') into 'out'. TIFF pages are decoded
+         * by 'tasks' jobs of 'parallel_for', ICS goes through an i3d image of 'file_t'.
+         * Resolution and offset are not set.
+         */
+        template <typename file_t, typename T, typename F>
+        void read(std::size_t t, std::size_t c, i3d::Image3d<T> &out, const i3d::VOI<i3d::PIXELS> *voi,
+                  F &&parallel_for, std::size_t tasks) const
+        {
+            if (m_format == format::tiff)
+            {
+                tiff_io::read_volume(m_path, m_pages, m_stack, t, c, out, voi, parallel_for, tasks);
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(library_mutex);
+            if (m_format == format::hdf5)
+            {
+                hdf5_io::read(m_path, m_dataset, t, c, out, voi);
+                return;
+            }
+
+            i3d::Image3d<file_t> img;
+            img.ReadImage(m_path.c_str(), voi, false, int(c));
+            out.MakeRoom(img.GetSize());
+            std::transform(img.GetFirstVoxelAddr(), img.GetFirstVoxelAddr() + img.GetImageSize(),
+                           out.GetFirstVoxelAddr(), [](file_t v)
+                           { return T(v); });
+        }
+
+    private:
+        format m_format = format::tiff;
+        std::string m_path, m_dataset;
+        std::size_t m_frames = 1, m_channels = 1;
+        bool m_channel_axis = false;
+        i3d::ImageHeader m_header;
+        tiff_io::hyperstack m_stack;
+        std::vector<tiff_io::page_ref> m_pages;
+    };
+
+    // 'path' with "_t<frame>_c<channel>" inserted before the extension
+    inline std::string volume_path(const std::string &path, std::size_t t, std::size_t c)
+    {
+        std::size_t dot = path.rfind('.');
+        std::size_t slash = path.find_last_of("/\\");
+        if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+            dot = path.size();
+
+        return path.substr(0, dot) + fmt::format("_t{:0>5}_c{:0>2}", t, c) + path.substr(dot);
+    }
+
+    template <typename T>
+    class sink
+    {
+    public:
+        /*
+         * Output of the volumes of 'input' to 'path', every volume is w x h x d (the size of the VOI
+         * written). Compression 'level' applies to HDF5, TIFF and Zarr output.
+         */
+        sink(const std::string &path, const source &input, std::size_t w, std::size_t h, std::size_t d,
+             int level, const i3d::Vector3d<float> &res)
+            : m_path(path), m_channels(input.channels()), m_level(level)
+        {
+            if (hdf5_io::has_hdf5_extension(path))
+            {
+                m_series = std::make_unique<hdf5_io::series_writer<T>>(path.c_str(), "/ced", w, h, d, level,
+                                                                       input.channel_axis() ? input.channels() : 0);
+                m_series->resolution(res);
+            }
+            else if (tiff_io::has_tiff_extension(path))
+                m_stack = std::make_unique<tiff_io::hyperstack_writer<T>>(path.c_str(), w, h, d, input.channels(),
+                                                                          input.frames(), level, res);
+        }
+
+        // Attributes of the HDF5 dataset, other formats have none
+        template <typename V>
+        void attribute(const char *name, const V &value)
+        {
+            std::lock_guard<std::mutex> lock(library_mutex);
+            if (m_series)
+                m_series->attribute(name, value);
+        }
+
+        /*
+         * Writes 'img' (or its 'voi') as frame 't', channel 'c'. A hyperstack is written in frame
+         * order, volumes that arrive early are kept until all volumes before them are written.
+         */
+        template <typename F>
+        void write(const i3d::Image3d<T> &img, const i3d::VOI<i3d::PIXELS> *voi, std::size_t t, std::size_t c,
+                   F &&parallel_for)
+        {
+            if (m_series)
+            {
+                std::lock_guard<std::mutex> lock(library_mutex);
+                m_series->write_frame(img, voi, t, c, parallel_for);
+            }
+            else if (m_stack)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                auto &frame = m_pending[t];
+                frame.resize(m_channels);
+
+                // a volume that completes the next frame is written as it is, only early ones are copied
+                std::size_t done = std::count_if(frame.begin(), frame.end(), [](const auto &volume)
+                                                 { return volume.has_value(); });
+                if (t != m_stack->frames() || done + 1 != m_channels)
+                {
+                    frame[c].emplace(img);
+                    return;
+                }
+
+                std::vector<const i3d::Image3d<T> *> channels;
+                for (std::size_t i = 0; i < m_channels; ++i)
+                    channels.push_back(i == c ? &img : &*frame[i]);
+                m_stack->append(channels, voi, parallel_for);
+                m_pending.erase(t);
+
+                // frames that arrived early follow once all their channels are done
+                for (auto next = m_pending.find(m_stack->frames()); next != m_pending.end();
+                     next = m_pending.find(m_stack->frames()))
+                {
+                    std::vector<const i3d::Image3d<T> *> channels;
+                    for (const auto &volume : next->second)
+                        if (volume)
+                            channels.push_back(&*volume);
+                    if (channels.size() != m_channels)
+                        break;
+
+                    m_stack->append(channels, voi, parallel_for);
+                    m_pending.erase(next);
+                }
+            }
+            else if (zarr_io::has_zarr_extension(m_path))
+                zarr_io::write(volume_path(m_path, t, c), img, voi, m_level, parallel_for);
+            else
+            {
+                std::lock_guard<std::mutex> lock(library_mutex);
+                img.SaveImage(volume_path(m_path, t, c).c_str(), i3d::IMG_UNKNOWN, m_level != 0, voi);
+            }
+        }
+
+    private:
+        std::string m_path;
+        std::size_t m_channels;
+        int m_level;
+        std::unique_ptr<hdf5_io::series_writer<T>> m_series;
+        std::unique_ptr<tiff_io::hyperstack_writer<T>> m_stack;
+        std::mutex m_mutex;
+        std::map<std::size_t, std::vector<std::optional<i3d::Image3d<T>>>> m_pending;
+    };
+}
@@ -0,0 +1,395 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <hdf5.h>
+#include <i3d/image3d.h>
+#include <i3d/imgfiles.h>
+
+#include "codec.hpp"
+
+/*
+ * HDF5 time-series output and multi-frame input.
+ *
+ * Every snapshot of a run is appended as one frame of a single chunked 4D (t, z, y, x) dataset
+ * whose time axis grows with each frame, multi-channel data get a 5D (t, c, z, y, x) dataset.
+ * A chunk covers one frame and channel, a few slices and a large in-slice tile, so reading a
+ * whole frame or a single slice of every frame touches few chunks. Chunks are deflate-compressed
+ * by 'parallel_for' jobs and stored as-is with H5Dwrite_chunk, the dataset still carries the
+ * deflate filter, so any HDF5 reader decodes it.
+ *
+ * 3D, 4D and 5D datasets in this layout are read one (frame, channel) volume at a time, HDF5
+ * converts the stored type. The library is not thread safe, callers serialise all calls.
+ */
+namespace hdf5_io
+{
+    template <typename T>
+    hid_t native_type()
+    {
+        if constexpr (std::is_same_v<T, std::uint8_t>)
+            return H5T_NATIVE_UINT8;
+        else if constexpr (std::is_same_v<T, std::uint16_t>)
+            return H5T_NATIVE_UINT16;
+        else if constexpr (std::is_same_v<T, float>)
+            return H5T_NATIVE_FLOAT;
+        else
+        {
+            static_assert(std::is_same_v<T, double>, "Unsupported voxel type");
+            return H5T_NATIVE_DOUBLE;
+        }
+    }
+
+    inline bool has_hdf5_extension(const std::string &fname)
+    {
+        std::string ext = fname.substr(std::min(fname.size(), fname.rfind('.')));
+        std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c)
+                       { return char(std::tolower(c)); });
+        return ext == ".h5" || ext == ".hdf5";
+    }
+
+    // Chunk extent along z and along y / x
+    constexpr std::size_t chunk_depth = 8;
+    constexpr std::size_t chunk_edge = 128;
+
+    // Raw bytes kept in memory per group of chunks being compressed
+    constexpr std::size_t write_group_bytes = std::size_t(256) << 20;
+
+    template <typename T>
+    class series_writer
+    {
+    public:
+        /*
+         * Creates (truncates) 'fname' with an empty w x h x d series named 'dataset', with a
+         * channel axis of 'channels' if that is not 0. Chunks are deflate-compressed at 'level',
+         * 0 stores them uncompressed.
+         */
+        series_writer(const char *fname, const char *dataset, std::size_t w, std::size_t h, std::size_t d,
+                      int level, std::size_t channels = 0)
+            : m_size{d, h, w},
+              m_chunk{std::min(chunk_depth, d), std::min(chunk_edge, h), std::min(chunk_edge, w)},
+              m_level(level), m_channels(channels)
+        {
+            m_file = H5Fcreate(fname, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+            if (m_file < 0)
+                throw std::runtime_error("Cannot create HDF5 file");
+
+            int rank = channels ? 5 : 4;
+            hsize_t dims[5] = {0, channels, d, h, w};
+            hsize_t max_dims[5] = {H5S_UNLIMITED, channels, d, h, w};
+            hsize_t chunk[5] = {1, 1, m_chunk[0], m_chunk[1], m_chunk[2]};
+            if (!channels)
+                for (int a = 1; a < 4; ++a)
+                    dims[a] = dims[a + 1], max_dims[a] = max_dims[a + 1], chunk[a] = chunk[a + 1];
+
+            hid_t space = H5Screate_simple(rank, dims, max_dims);
+            hid_t props = H5Pcreate(H5P_DATASET_CREATE);
+            H5Pset_chunk(props, rank, chunk);
+            if (m_level != 0)
+                H5Pset_deflate(props, unsigned(m_level));
+
+            m_dataset = H5Dcreate2(m_file, dataset, native_type<T>(), space, H5P_DEFAULT, props, H5P_DEFAULT);
+            H5Pclose(props);
+            H5Sclose(space);
+
+            if (m_dataset < 0)
+            {
+                H5Fclose(m_file);
+                throw std::runtime_error("Cannot create HDF5 dataset");
+            }
+        }
+
+        ~series_writer()
+        {
+            H5Dclose(m_dataset);
+            H5Fclose(m_file);
+        }
+
+        series_writer(const series_writer &) = delete;
+        series_writer &operator=(const series_writer &) = delete;
+
+        void attribute(const char *name, double value)
+        {
+            write_attribute(name, H5T_NATIVE_DOUBLE, 0, &value);
+        }
+
+        void attribute(const char *name, const std::string &value)
+        {
+            hid_t type = H5Tcopy(H5T_C_S1);
+            H5Tset_size(type, std::max<std::size_t>(1, value.size()));
+            write_attribute(name, type, 0, value.c_str());
+            H5Tclose(type);
+        }
+
+        // Voxel size as the (z, y, x) "element_size_um" attribute, from a resolution in pixels per micron
+        void resolution(const i3d::Vector3d<float> &res)
+        {
+            double size[3] = {1.0 / res.z, 1.0 / res.y, 1.0 / res.x};
+            write_attribute("element_size_um", H5T_NATIVE_DOUBLE, 3, size);
+        }
+
+        /*
+         * Appends 'img' (or just its 'voi', which must match the series size) as the frame of
+         * 'iteration'. Iterations of all frames are kept in the "iterations" attribute.
+         */
+        template <typename F>
+        void write(const i3d::Image3d<T> &img, const i3d::VOI<i3d::PIXELS> *voi, std::size_t iteration,
+                   F &&parallel_for)
+        {
+            write_frame(img, voi, m_iterations.size(), 0, parallel_for);
+
+            m_iterations.push_back(std::uint64_t(iteration));
+            write_attribute("iterations", H5T_NATIVE_UINT64, m_iterations.size(), m_iterations.data());
+            H5Fflush(m_file, H5F_SCOPE_LOCAL);
+        }
+
+        // Writes 'img' (or its 'voi') as frame 't', channel 'c', in any order, the time axis grows to fit
+        template <typename F>
+        void write_frame(const i3d::Image3d<T> &img, const i3d::VOI<i3d::PIXELS> *voi, std::size_t t, std::size_t c,
+                         F &&parallel_for)
+        {
+            std::size_t x0 = 0, y0 = 0, z0 = 0;
+            if (voi)
+                x0 = voi->offset.x, y0 = voi->offset.y, z0 = voi->offset.z;
+
+            if (c >= std::max<std::size_t>(m_channels, 1))
+                throw std::out_of_range("Channel out of range");
+
+            m_frames = std::max<hsize_t>(m_frames, t + 1);
+            std::vector<hsize_t> dims = {m_frames, m_channels, m_size[0], m_size[1], m_size[2]};
+            if (!m_channels)
+                dims.erase(dims.begin() + 1);
+            if (H5Dset_extent(m_dataset, dims.data()) < 0)
+                throw std::runtime_error("Cannot extend HDF5 dataset");
+
+            std::array<std::size_t, 3> count;
+            for (std::size_t a = 0; a < 3; ++a)
+                count[a] = (m_size[a] + m_chunk[a] - 1) / m_chunk[a];
+
+            std::size_t chunk_voxels = m_chunk[0] * m_chunk[1] * m_chunk[2];
+            std::size_t frame_chunks = count[0] * count[1] * count[2];
+            std::size_t group = std::max<std::size_t>(1, write_group_bytes / (chunk_voxels * sizeof(T)));
+
+            std::vector<std::vector<unsigned char>> chunks;
+            const T *data = img.GetFirstVoxelAddr();
+            std::size_t sx = img.GetSizeX(), sy = img.GetSizeY();
+
+            auto origin = [&](std::size_t i)
+            {
+                return std::array<std::size_t, 3>{i / (count[1] * count[2]) * m_chunk[0],
+                                                  i / count[2] % count[1] * m_chunk[1],
+                                                  i % count[2] * m_chunk[2]};
+            };
+
+            for (std::size_t g0 = 0; g0 < frame_chunks; g0 += group)
+            {
+                chunks.assign(std::min(group, frame_chunks - g0), {});
+
+                parallel_for(chunks.size(), [&](std::size_t i)
+                             {
+                                 auto o = origin(g0 + i);
+
+                                 // edge chunks are padded with zeros to the full chunk size
+                                 std::vector<T> chunk(chunk_voxels, T(0));
+                                 std::size_t cw = std::min(m_chunk[2], m_size[2] - o[2]);
+                                 for (std::size_t z = o[0]; z < std::min(o[0] + m_chunk[0], m_size[0]); ++z)
+                                     for (std::size_t y = o[1]; y < std::min(o[1] + m_chunk[1], m_size[1]); ++y)
+                                         std::copy_n(data + ((z0 + z) * sy + y0 + y) * sx + x0 + o[2], cw,
+                                                     chunk.data() + ((z - o[0]) * m_chunk[1] + y - o[1]) * m_chunk[2]);
+
+                                 const auto *raw = reinterpret_cast<const unsigned char *>(chunk.data());
+                                 std::size_t raw_size = chunk.size() * sizeof(T);
+                                 chunks[i] = m_level == 0 ? std::vector<unsigned char>(raw, raw + raw_size)
+                                                          : codec::compress(raw, raw_size, m_level);
+                             });
+
+                for (std::size_t i = 0; i < chunks.size(); ++i)
+                {
+                    auto o = origin(g0 + i);
+                    std::vector<hsize_t> offset = {t, c, o[0], o[1], o[2]};
+                    if (!m_channels)
+                        offset.erase(offset.begin() + 1);
+                    auto &chunk = chunks[i];
+                    if (H5Dwrite_chunk(m_dataset, H5P_DEFAULT, 0, offset.data(), chunk.size(), chunk.data()) < 0)
+                        throw std::runtime_error("Failed to write HDF5 chunk");
+                    std::vector<unsigned char>().swap(chunk);
+                }
+            }
+        }
+
+    private:
+        std::array<std::size_t, 3> m_size;
+        std::array<std::size_t, 3> m_chunk;
+        int m_level;
+        std::size_t m_channels;
+        hsize_t m_frames = 0;
+        hid_t m_file = -1;
+        hid_t m_dataset = -1;
+        std::vector<std::uint64_t> m_iterations;
+
+        // Replaces the attribute 'name' of the dataset, 'count' 0 makes it scalar
+        void write_attribute(const char *name, hid_t type, std::size_t count, const void *value)
+        {
+            if (H5Aexists(m_dataset, name) > 0)
+                H5Adelete(m_dataset, name);
+
+            hsize_t dims[1] = {count};
+            hid_t space = count == 0 ? H5Screate(H5S_SCALAR) : H5Screate_simple(1, dims, nullptr);
+            hid_t attr = H5Acreate2(m_dataset, name, type, space, H5P_DEFAULT, H5P_DEFAULT);
+            herr_t status = attr < 0 ? -1 : H5Awrite(attr, type, value);
+
+            if (attr >= 0)
+                H5Aclose(attr);
+            H5Sclose(space);
+
+            if (status < 0)
+                throw std::runtime_error("Failed to write HDF5 attribute");
+        }
+    };
+
+    // Shape of a 3D (z, y, x), 4D (t, z, y, x) or 5D (t, c, z, y, x) dataset
+    struct dataset_info
+    {
+        int rank = 3;
+        std::size_t frames = 1, channels = 1;
+        i3d::ImageHeader header;
+    };
+
+    // Whether 'fname' is an HDF5 file holding 'dataset', without printing HDF5 errors
+    inline bool has_dataset(const std::string &fname, const std::string &dataset)
+    {
+        if (!has_hdf5_extension(fname))
+            return false;
+
+        H5E_auto2_t handler;
+        void *data;
+        H5Eget_auto2(H5E_DEFAULT, &handler, &data);
+        H5Eset_auto2(H5E_DEFAULT, nullptr, nullptr);
+
+        hid_t file = H5Fopen(fname.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+        bool found = file >= 0 && H5Oexists_by_name(file, dataset.c_str(), H5P_DEFAULT) > 0;
+        if (file >= 0)
+            H5Fclose(file);
+
+        H5Eset_auto2(H5E_DEFAULT, handler, data);
+        return found;
+    }
+
+    inline dataset_info read_info(const std::string &fname, const std::string &dataset)
+    {
+        hid_t file = H5Fopen(fname.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+        if (file < 0)
+            throw std::runtime_error("Cannot open HDF5 file " + fname);
+        hid_t set = H5Dopen2(file, dataset.c_str(), H5P_DEFAULT);
+        if (set < 0)
+        {
+            H5Fclose(file);
+            throw std::runtime_error("Cannot open HDF5 dataset " + dataset);
+        }
+
+        hid_t space = H5Dget_space(set);
+        int rank = H5Sget_simple_extent_ndims(space);
+        hsize_t dims[5] = {};
+        if (rank >= 3 && rank <= 5)
+            H5Sget_simple_extent_dims(space, dims, nullptr);
+        H5Sclose(space);
+
+        hid_t type = H5Dget_type(set);
+        H5T_class_t type_class = H5Tget_class(type);
+        std::size_t type_size = H5Tget_size(type);
+        H5Tclose(type);
+
+        // (z, y, x) voxel size, if the file has one
+        double element_size[3] = {1.0, 1.0, 1.0};
+        if (H5Aexists(set, "element_size_um") > 0)
+        {
+            hid_t attr = H5Aopen(set, "element_size_um", H5P_DEFAULT);
+            hid_t attr_space = H5Aget_space(attr);
+            if (H5Sget_simple_extent_npoints(attr_space) == 3)
+                H5Aread(attr, H5T_NATIVE_DOUBLE, element_size);
+            H5Sclose(attr_space);
+            H5Aclose(attr);
+        }
+
+        H5Dclose(set);
+        H5Fclose(file);
+
+        if (rank < 3 || rank > 5)
+            throw std::runtime_error("Only 3D, 4D and 5D HDF5 datasets are supported");
+
+        dataset_info info;
+        info.rank = rank;
+        info.frames = rank > 3 ? std::size_t(dims[0]) : 1;
+        info.channels = rank == 5 ? std::size_t(dims[1]) : 1;
+
+        i3d::ImgVoxelType voxel = i3d::UnknownVoxel;
+        if (type_class == H5T_FLOAT)
+            voxel = type_size == 8 ? i3d::DoubleVoxel : i3d::FloatVoxel;
+        else if (type_class == H5T_INTEGER)
+            voxel = type_size == 1 ? i3d::Gray8Voxel : type_size == 2 ? i3d::Gray16Voxel : i3d::IntegerVoxel;
+
+        const hsize_t *zyx = dims + rank - 3;
+        i3d::Vector3d<float> res(float(1.0 / element_size[2]), float(1.0 / element_size[1]), float(1.0 / element_size[0]));
+        info.header = i3d::ImageHeader(i3d::Vector3d<std::size_t>(zyx[2], zyx[1], zyx[0]), voxel, i3d::Offset(), &res);
+        return info;
+    }
+
+    // Reads the volume of frame 't', channel 'c' (or its 'voi') into 'out', resolution and offset are not set
+    template <typename T>
+    void read(const std::string &fname, const std::string &dataset, std::size_t t, std::size_t c,
+              i3d::Image3d<T> &out, const i3d::VOI<i3d::PIXELS> *voi)
+    {
+        dataset_info info = read_info(fname, dataset);
+        auto size = info.header.size;
+        if (t >= info.frames || c >= info.channels)
+            throw std::out_of_range("Frame or channel out of range");
+
+        std::size_t x0 = 0, y0 = 0, z0 = 0, w = size.x, h = size.y, d = size.z;
+        if (voi)
+        {
+            x0 = voi->offset.x, y0 = voi->offset.y, z0 = voi->offset.z;
+            w = voi->size.x, h = voi->size.y, d = voi->size.z;
+        }
+        if (x0 + w > size.x || y0 + h > size.y || z0 + d > size.z)
+            throw std::out_of_range("VOI exceeds the HDF5 dataset");
+
+        out.MakeRoom(w, h, d);
+        if (w * h * d == 0)
+            return;
+
+        // (t, c, z, y, x) without the axes the dataset does not have
+        std::vector<hsize_t> start = {t, c, z0, y0, x0}, count = {1, 1, d, h, w};
+        if (info.rank == 4)
+            start.erase(start.begin() + 1), count.erase(count.begin() + 1);
+        else if (info.rank == 3)
+            start.erase(start.begin(), start.begin() + 2), count.erase(count.begin(), count.begin() + 2);
+
+        hid_t file = H5Fopen(fname.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+        hid_t set = file < 0 ? -1 : H5Dopen2(file, dataset.c_str(), H5P_DEFAULT);
+        hid_t space = set < 0 ? -1 : H5Dget_space(set);
+        hsize_t voxels[1] = {w * h * d};
+        hid_t memory = H5Screate_simple(1, voxels, nullptr);
+
+        herr_t status = space < 0 ? -1 : H5Sselect_hyperslab(space, H5S_SELECT_SET, start.data(), nullptr, count.data(), nullptr);
+        if (status >= 0)
+            status = H5Dread(set, native_type<T>(), memory, space, H5P_DEFAULT, out.GetFirstVoxelAddr());
+
+        H5Sclose(memory);
+        if (space >= 0)
+            H5Sclose(space);
+        if (set >= 0)
+            H5Dclose(set);
+        if (file >= 0)
+            H5Fclose(file);
+
+        if (status < 0)
+            throw std::runtime_error("Failed to read HDF5 dataset " + dataset);
+    }
+}
@@ -1,12 +1,21 @@
 #include <boost/program_options.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <vector>
 #include <chrono>
+#include <cmath>
 #include <fmt/core.h>
 #include <i3d/diffusion_filters.h>
+#include <i3d/transform.h>
 #include <iostream>
 #include <limits>
+#include <new>
+#include <optional>
+#include <sstream>
 #include <string>
 #include <thread>
+#include <type_traits>
 
 using namespace std::literals;
 namespace po = boost::program_options;
@@ -14,18 +23,110 @@ namespace po = boost::program_options;
 // program options (constants after 'parse_args' is called)
 std::size_t po_threads = std::thread::hardware_concurrency() / 2;
 std::string po_precision = "float"s;
-std::string po_image_format = "uint16"s;
+std::string po_image_format = "auto"s;
+std::string po_backend = "i3d"s;
+std::string po_gauss = "fir"s;
+std::string po_filter = "ced"s;
+double po_lambda = 1.0;
+std::string po_dataset = "/ced"s;
+std::size_t po_frame_threads = 0;
 double po_sigma = 0.1;
 double po_rho = 1.0;
 double po_tau = 0.05;
 std::size_t po_iters = 1;
+std::size_t po_inner_iters = 1;
+bool po_inner_reference = false;
+std::size_t po_tensor_refresh = 1;
+double po_tensor_threshold = 0.0;
+bool po_tensor_reference = false;
 std::size_t po_save_every = 0;
+std::string po_voi;
+long po_halo = -1;
+bool po_voi_paste = false;
+bool po_sequence = false;
+int po_compression_level = 6;
+bool po_masked = false;
+double po_mask_threshold = 0.0;
+std::string po_mask_file;
+long po_mask_margin = -1;
+std::size_t po_pyramid = 0;
+std::size_t po_pyramid_scale = 2;
+bool po_pyramid_reference = false;
+std::string po_trace;
+bool po_perf_counters = false;
+bool po_profile = false;
 bool po_quiet = false;
 std::string po_input_file;
 std::string po_output_file;
 
 // make sure details are included after program opttions
 #include "details.hpp"
+#include "ced.hpp"
+#include "filters.hpp"
+#include "frames.hpp"
+#include "hdf5_io.hpp"
+#include "mask.hpp"
+#include "memory.hpp"
+#include "metaio_io.hpp"
+#include "perf.hpp"
+#include "pool.hpp"
+#include "quality.hpp"
+#include "trace.hpp"
+#include "tiff_io.hpp"
+#include "zarr_io.hpp"
+
+// Heap allocations are counted for --profile, the blocks stay plain malloc / free ones
+#if defined(__linux__)
+void *operator new(std::size_t size)
+{
+	if (void *p = memory::allocate(size))
+		return p;
+	throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+	memory::release(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+	memory::release(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+	memory::release(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept
+{
+	memory::release(p);
+}
+#endif
+
+// "x,y,z,w,h,d" to a VOI, nothing if the string is malformed or the VOI is empty
+std::optional<i3d::VOI<i3d::PIXELS>> parse_voi(std::string s)
+{
+	std::replace(s.begin(), s.end(), ',', ' ');
+	std::istringstream in(s);
+
+	std::array<long, 6> v{};
+	for (auto &val : v)
+		if (!(in >> val) || val < 0)
+			return std::nullopt;
+
+	if (!(in >> std::ws).eof() || v[3] == 0 || v[4] == 0 || v[5] == 0)
+		return std::nullopt;
+
+	return i3d::VOI<i3d::PIXELS>(int(v[0]), int(v[1]), int(v[2]),
+								 std::size_t(v[3]), std::size_t(v[4]), std::size_t(v[5]));
+}
 
 void parse_args(int argc, const char **argv)
 {
@@ -33,26 +134,106 @@ void parse_args(int argc, const char **argv)
 	desc.add_options()("help,h", "print help message") // Help
 		("image_format,f",
 		 po::value(&po_image_format)->default_value(po_image_format),
-		 "Image format type {uint8, uint16, float, double}") // image format
+		 "Image format type {auto, uint8, uint16, float, double}, 'auto' "
+		 "uses the voxel type of the input, a float or double input that "
+		 "matches --precision is then filtered without conversion") // image format
+		("filter", po::value(&po_filter)->default_value(po_filter),
+		 "Filter applied to the slices {ced, eed, gauss, pm, tv}") // Filter
 		("sigma,s", po::value(&po_sigma)->default_value(po_sigma),
 		 "Standard deviation of the Gaussian filter that is applied before the "
 		 "gradient estimation.") // Sigma
 		("rho,r", po::value(&po_rho)->default_value(po_rho),
 		 "Standard deviation of the Gaussian filter that is applied in order "
 		 "to smooth structure tensors.") // Rho
+		("lambda,l", po::value(&po_lambda)->default_value(po_lambda),
+		 "Contrast parameter ( intensity units ) of the eed, pm and tv filters") // Lambda
 		("tau,t", po::value(&po_tau)->default_value(po_tau),
 		 "Time step of one iteration.") // Tau
 		("iters,i", po::value(&po_iters)->default_value(po_iters),
 		 "Number of iterations") // Iters
+		("inner_iters", po::value(&po_inner_iters)->default_value(po_inner_iters),
+		 "Iterations run on every slice while it is gathered, before the next "
+		 "axis, fewer gathers and scatters at the cost of a coarser operator "
+		 "splitting, 1 means strict interleaving") // Inner iters
+		("inner_reference",
+		 "Also run with strict interleaving ( --inner_iters 1 ) and report the "
+		 "difference of the result") // Inner reference
+		("tensor_refresh", po::value(&po_tensor_refresh)->default_value(po_tensor_refresh),
+		 "Keep the diffusion tensor of every slice and recompute it only every "
+		 "x steps of the slice, 1 means every step ( no cache ), 0 means only "
+		 "on --tensor_threshold, native CED only, costs 3 values per voxel "
+		 "and axis") // Tensor refresh
+		("tensor_threshold", po::value(&po_tensor_threshold)->default_value(po_tensor_threshold),
+		 "Also recompute a cached tensor once the RMS change of its slice "
+		 "since the last recomputation exceeds this ( intensity units, 0 "
+		 "means never ), costs one more value per voxel and axis") // Tensor threshold
+		("tensor_reference",
+		 "Also run without the tensor cache and report the difference of the "
+		 "result") // Tensor reference
 		("max_threads", po::value(&po_threads)->default_value(po_threads),
 		 "Maximum number of work threads to use ( 0 means 'all' )") // Threads
+		("frame_threads", po::value(&po_frame_threads)->default_value(po_frame_threads),
+		 "Threads per volume of multi-frame / multi-channel input, the other "
+		 "threads run further volumes at the same time ( 0 means sized from "
+		 "the volume )") // Frame threads
+		("dataset", po::value(&po_dataset)->default_value(po_dataset),
+		 "Dataset of HDF5 input, 3D (z, y, x), 4D (t, z, y, x) or 5D "
+		 "(t, c, z, y, x)") // Dataset
 		("save_every", po::value(&po_save_every)->default_value(po_save_every),
-		 "Save every xth iteration ( e.g. name_f20.tif for frame 20 ), 0 means "
-		 "do not save anything") // Save
+		 "Save every xth iteration ( e.g. name_f20.tif for frame 20, .h5 output "
+		 "stores all of them as frames of one series ), 0 means do not save anything") // Save
 		("quiet",
 		 "Disable standard output") // Quiet
 		("precision", po::value(&po_precision)->default_value(po_precision),
 		 "Precision for computation {float, double}") // Precision
+		("sequence",
+		 "Input file is a pattern of a 2D image sequence (one file per "
+		 "slice)") // Sequence
+		("compression_level", po::value(&po_compression_level)->default_value(po_compression_level),
+		 "Deflate level of TIFF, HDF5 and Zarr output {0 - 9}, 0 means uncompressed") // Compression
+		("voi", po::value(&po_voi),
+		 "Process only the volume of interest 'x,y,z,w,h,d' (in voxels), "
+		 "only the VOI grown by the halo is read") // VOI
+		("halo", po::value(&po_halo)->default_value(po_halo),
+		 "Voxels read around the VOI, -1 means sized from sigma, rho, tau and "
+		 "iters") // Halo
+		("voi_paste",
+		 "Paste the filtered VOI into a copy of the input instead of saving "
+		 "the VOI alone") // VOI paste
+		("mask_threshold", po::value(&po_mask_threshold),
+		 "Skip slices and rows with no voxel above this intensity (after "
+		 "dilation by the mask margin)") // Mask threshold
+		("mask", po::value(&po_mask_file),
+		 "Skip slices and rows with no non-zero voxel of this mask image "
+		 "(after dilation by the mask margin)") // Mask file
+		("mask_margin", po::value(&po_mask_margin)->default_value(po_mask_margin),
+		 "Dilation of the mask in voxels, -1 means sized from sigma, rho, tau "
+		 "and iters") // Mask margin
+		("pyramid", po::value(&po_pyramid)->default_value(po_pyramid),
+		 "Run the first x iterations on a downsampled grid with sigma, rho and "
+		 "tau scaled to match, 0 means full resolution only") // Pyramid
+		("pyramid_scale", po::value(&po_pyramid_scale)->default_value(po_pyramid_scale),
+		 "Downsampling factor of the pyramid {2, 4}") // Pyramid scale
+		("pyramid_reference",
+		 "Also run all iterations at full resolution and report the difference "
+		 "of the pyramid result") // Pyramid reference
+		("trace", po::value(&po_trace),
+		 "Write a timeline of every thread to this file ( Chrome trace event "
+		 "JSON )") // Trace
+		("perf_counters",
+		 "Report hardware performance counters per phase ( Linux only, needs "
+		 "perf_event_open permission )") // Perf counters
+		("profile",
+		 "Report time, heap allocations and peak memory per phase ( Linux only, "
+		 "elsewhere only the time )") // Profile
+		("backend", po::value(&po_backend)->default_value(po_backend),
+		 "CED implementation {i3d, native}, 'native' solves the AOS lines "
+		 "in SIMD batches, eed and gauss always run on i3d, pm and tv "
+		 "always run natively") // Backend
+		("gauss", po::value(&po_gauss)->default_value(po_gauss),
+		 "Gaussian used by the native backend and the pm and tv filters for "
+		 "sigma and rho smoothing {fir, deriche, young}, the recursive ones "
+		 "cost the same for any sigma") // Gauss
 
 		;
 	po::options_description hidden_desc;
@@ -106,13 +287,117 @@ void parse_args(int argc, const char **argv)
 	}
 
 	if (std::string val = vm["image_format"].as<std::string>();
-		!(val == "uint8"s || val == "uint16"s || val == "float"s ||
+		!(val == "auto"s || val == "uint8"s || val == "uint16"s || val == "float"s ||
 		  val == "double"s))
 	{
 		std::cerr << "Invalid image format choice" << std::endl;
 		std::terminate();
 	}
 
+	if (std::string val = vm["backend"].as<std::string>();
+		!(val == "i3d"s || val == "native"s))
+	{
+		std::cerr << "Invalid backend choice" << std::endl;
+		std::terminate();
+	}
+
+	if (!filters::is_known(po_filter, po_backend))
+	{
+		std::cerr << "Invalid filter choice" << std::endl;
+		std::terminate();
+	}
+
+	if (po_filter != "ced"s && po_filter != "gauss"s && !(po_lambda > 0.0))
+	{
+		std::cerr << "Lambda must be positive" << std::endl;
+		std::terminate();
+	}
+
+	if (std::string val = vm["gauss"].as<std::string>();
+		!(val == "fir"s || val == "deriche"s || val == "young"s))
+	{
+		std::cerr << "Invalid gauss choice" << std::endl;
+		std::terminate();
+	}
+
+	if (!po_voi.empty() && !parse_voi(po_voi))
+	{
+		std::cerr << "Invalid VOI, expected 'x,y,z,w,h,d'" << std::endl;
+		std::terminate();
+	}
+
+	if (po_inner_iters == 0)
+	{
+		std::cerr << "Inner iterations must be at least 1" << std::endl;
+		std::terminate();
+	}
+
+	// Snapshots are taken between passes, which end at the coarse iterations plus multiples of
+	// the inner iterations
+	if (po_save_every != 0 &&
+		(po_save_every % po_inner_iters != 0 || std::min(po_pyramid, po_iters) % po_inner_iters != 0))
+	{
+		std::cerr << "Save every and the pyramid iterations must be multiples of inner iterations" << std::endl;
+		std::terminate();
+	}
+
+	if (vm.count("inner_reference"))
+		po_inner_reference = true;
+
+	if ((po_tensor_refresh != 1 || po_tensor_threshold != 0.0) &&
+		!filters::supports_caching(po_filter, po_backend))
+	{
+		std::cerr << "Tensor caching needs --filter ced --backend native" << std::endl;
+		std::terminate();
+	}
+
+	if (po_tensor_threshold < 0.0 || (po_tensor_refresh == 1 && po_tensor_threshold != 0.0) ||
+		(po_tensor_refresh == 0 && po_tensor_threshold == 0.0))
+	{
+		std::cerr << "Tensor threshold must be positive and needs a tensor refresh other than 1, "
+					 "a refresh of 0 needs a threshold"
+				  << std::endl;
+		std::terminate();
+	}
+
+	if (vm.count("tensor_reference"))
+		po_tensor_reference = true;
+
+	if (vm.count("voi_paste"))
+		po_voi_paste = true;
+
+	if (vm.count("sequence"))
+		po_sequence = true;
+
+	if (po_compression_level < 0 || po_compression_level > 9)
+	{
+		std::cerr << "Invalid compression level" << std::endl;
+		std::terminate();
+	}
+
+	if (!(po_pyramid_scale == 2 || po_pyramid_scale == 4))
+	{
+		std::cerr << "Invalid pyramid scale choice" << std::endl;
+		std::terminate();
+	}
+
+	if (vm.count("pyramid_reference"))
+		po_pyramid_reference = true;
+
+	if (vm.count("perf_counters"))
+		po_perf_counters = true;
+
+	if (vm.count("profile"))
+		po_profile = true;
+
+	if (vm.count("mask_threshold") && vm.count("mask"))
+	{
+		std::cerr << "Use either a mask threshold or a mask image" << std::endl;
+		std::terminate();
+	}
+
+	po_masked = vm.count("mask_threshold") || vm.count("mask");
+
 	if (vm.count("quiet"))
 		po_quiet = true;
 
@@ -159,19 +444,122 @@ void set_slices(i3d::Image3d<img_t> &img,
 	throw std::out_of_range("Axis out of range");
 }
 
-template <typename in_t, typename out_t>
-void copy(i3d::Image3d<out_t> &dest, const i3d::Image3d<in_t> &src)
+gauss::backend get_gauss_backend()
+{
+	if (po_gauss == "deriche")
+		return gauss::backend::deriche;
+	if (po_gauss == "young")
+		return gauss::backend::young;
+	return gauss::backend::fir;
+}
+
+ced::refresh_policy get_refresh_policy()
+{
+	return {po_tensor_refresh, po_tensor_threshold};
+}
+
+/*
+ * Distance in voxels beyond which the filter has negligible (not zero) influence: the support
+ * of one structure tensor (3 sigma + 3 rho + the derivative stencils) plus three standard
+ * deviations of the distance diffusion travels in all iterations, every axis is diffused by
+ * two of the three sweeps. Only CED smooths with rho, a Gauss iteration diffuses for sigma^2 / 2.
+ */
+std::size_t get_influence_radius()
+{
+	double rho = po_filter == "ced"s ? po_rho : 0.0;
+	double tau = po_filter == "gauss"s ? 0.5 * po_sigma * po_sigma : po_tau;
+	return std::size_t(std::ceil(3 * (po_sigma + rho)) + 2 +
+					   std::ceil(3 * std::sqrt(4 * tau * po_iters)));
+}
+
+std::size_t get_halo()
+{
+	return po_halo >= 0 ? std::size_t(po_halo) : get_influence_radius();
+}
+
+std::size_t get_mask_margin()
+{
+	return po_mask_margin >= 0 ? std::size_t(po_mask_margin) : get_influence_radius();
+}
+
+// Voxels above the threshold or non-zero in the mask image, which is read with the same VOI as 'img'
+template <typename T>
+std::vector<bool> get_foreground(const i3d::Image3d<T> &img, const i3d::VOI<i3d::PIXELS> *voi)
+{
+	std::vector<bool> foreground(img.GetImageSize());
+
+	if (po_mask_file.empty())
+	{
+		for (std::size_t i = 0; i < foreground.size(); ++i)
+			foreground[i] = double(img.GetVoxel(i)) > po_mask_threshold;
+		return foreground;
+	}
+
+	auto read = [&](auto zero)
+	{
+		i3d::Image3d<decltype(zero)> mask(po_mask_file.c_str(), voi);
+		if (mask.GetSize() != img.GetSize())
+			throw std::invalid_argument("Mask size differs from the input image");
+
+		for (std::size_t i = 0; i < foreground.size(); ++i)
+			foreground[i] = mask.GetVoxel(i) != zero;
+	};
+
+	switch (i3d::ReadImageType(po_mask_file.c_str()))
+	{
+	case i3d::BinaryVoxel:
+		read(bool(false));
+		break;
+	case i3d::Gray8Voxel:
+		read(i3d::GRAY8(0));
+		break;
+	case i3d::Gray16Voxel:
+		read(i3d::GRAY16(0));
+		break;
+	case i3d::FloatVoxel:
+		read(float(0));
+		break;
+	default:
+		throw std::invalid_argument("Unsupported mask voxel type");
+	}
+
+	return foreground;
+}
+
+// VOI grown by 'halo' on every side and clipped to an image of 'size'
+i3d::VOI<i3d::PIXELS> grow_voi(const i3d::VOI<i3d::PIXELS> &voi, std::size_t halo,
+							   const i3d::Vector3d<std::size_t> &size)
 {
-	dest.MakeRoom(src.GetSize());
-	for (std::size_t x = 0; x < src.GetSizeX(); ++x)
-		for (std::size_t y = 0; y < src.GetSizeY(); ++y)
-			for (std::size_t z = 0; z < src.GetSizeZ(); ++z)
-				dest.SetVoxel(
-					x, y, z,
-					out_t(std::min<double>(
-						std::max<double>(src.GetVoxel(x, y, z),
-										 std::numeric_limits<out_t>::min()),
-						std::numeric_limits<out_t>::max())));
+	i3d::VOI<i3d::PIXELS> grown(voi.offset - int(halo), voi.size + 2 * halo);
+	grown *= i3d::VOI<i3d::PIXELS>(0, 0, 0, size.x, size.y, size.z);
+	return grown;
+}
+
+// The --voi, the region read for it (grown by the halo) and the VOI relative to what was read
+struct voi_regions
+{
+	i3d::VOI<i3d::PIXELS> voi, read_voi, inner;
+};
+
+voi_regions get_voi_regions(const i3d::Vector3d<std::size_t> &size)
+{
+	voi_regions r;
+	if (po_voi.empty())
+		return r;
+
+	r.voi = *parse_voi(po_voi);
+	if (std::size_t(r.voi.offset.x) + r.voi.size.x > size.x ||
+		std::size_t(r.voi.offset.y) + r.voi.size.y > size.y ||
+		std::size_t(r.voi.offset.z) + r.voi.size.z > size.z)
+		throw std::out_of_range("VOI exceeds the input image");
+
+	r.read_voi = grow_voi(r.voi, get_halo(), size);
+	r.inner = i3d::VOI<i3d::PIXELS>(r.voi.offset - r.read_voi.offset, r.voi.size);
+
+	print(fmt::format("\tVOI: {} {} {}, {} x {} x {}, halo {}",
+					  r.voi.offset.x, r.voi.offset.y, r.voi.offset.z,
+					  r.voi.size.x, r.voi.size.y, r.voi.size.z, get_halo()));
+	return r;
 }
 
 std::pair<std::size_t, std::size_t> get_job_range(std::size_t thread_id, std::size_t thread_count, std::size_t total_job_size)
@@ -181,50 +569,596 @@ std::pair<std::size_t, std::size_t> get_job_range(std::size_t thread_id, std::si
 	return {start_idx, end_idx};
 }
 
+/*
+ * Runs 'iters' iterations of the --filter on 'work' in place with 'thread_count' jobs per axis,
+ * 'rects' restricts every slice to its rectangle (see mask.hpp). Every gathered slice is advanced
+ * 'inner_iters' iterations before it is scattered and the next axis starts, so a pass over the
+ * three axes covers 'inner_iters' iterations. 'on_iteration(it)' is called after every pass with
+ * the iterations done so far. Returns the number of slice voxels that were filtered and the number there are.
+ */
+template <typename prec_t, typename F>
+std::pair<std::size_t, std::size_t> run_filter(pool::thread_pool &threads, std::size_t thread_count,
+											   i3d::Image3d<prec_t> &work, const filters::params &params,
+											   std::size_t iters, std::size_t inner_iters,
+											   const std::array<std::vector<mask::rect>, 3> &rects,
+											   F &&on_iteration)
+{
+	std::atomic<std::size_t> processed = 0, total = 0;
+
+	// One filter per thread, sized for the largest slice of any axis
+	std::size_t max_width = std::max(work.GetSizeX(), work.GetSizeY());
+	std::size_t max_height = std::max(work.GetSizeY(), work.GetSizeZ());
+	std::vector<std::unique_ptr<filters::slice_filter<prec_t>>> slice_filters;
+	for (std::size_t t = 0; t < thread_count; ++t)
+		slice_filters.push_back(filters::make<prec_t>(po_filter, po_backend, max_width, max_height, params));
+	const filters::slice_filter<prec_t> &filter = *slice_filters.front();
+
+	// Axes with fewer slices than threads split every slice step across the pool instead of
+	// leaving threads idle, if the filter can
+	std::array<bool, 3> intra_slice{};
+	filters::pool_split split{1, [&threads](std::size_t count, const std::function<void(std::size_t)> &fn)
+							  { threads.parallel_for(count, fn); }};
+	if (filter.splits())
+		for (std::size_t axis = 0; axis < 3; ++axis)
+		{
+			std::size_t count = work.GetSize()[axis];
+			intra_slice[axis] = count < thread_count;
+			if (intra_slice[axis])
+				split.parts = std::max(split.parts, (thread_count + count - 1) / count);
+		}
+
+	// Axes with small slices are advanced 'lanes' slices at a time if the filter batches them
+	std::array<std::size_t, 3> lanes{};
+	for (std::size_t axis = 0; axis < 3; ++axis)
+	{
+		auto [w, h] = slices::slice_size(work, axis);
+		std::size_t n = filter.batch_lanes(w, h);
+		if (!intra_slice[axis] && n > 1 && work.GetSize()[axis] >= n)
+			lanes[axis] = n;
+	}
+
+	// Filter state kept across iterations, one per slice of every axis (one per batch, at its
+	// first slice, on batched axes), set up when the slice is first stepped
+	bool cache_slices = filter.caches();
+	std::array<std::vector<filters::slice_cache<prec_t>>, 3> caches;
+	if (cache_slices)
+		for (std::size_t axis = 0; axis < 3; ++axis)
+			caches[axis].resize(work.GetSize()[axis]);
+
+	// Iterations of the current pass, every slice is stepped this many times per gather
+	std::size_t steps = 1;
+
+	auto worker = [&](std::size_t id, std::size_t axis, std::size_t thread_count)
+	{
+		auto [first, end] = get_job_range(id, thread_count, work.GetSize()[axis]);
+		auto [w, h] = slices::slice_size(work, axis);
+		std::size_t start = first;
+		const auto &axis_rects = rects[axis];
+		std::size_t done = 0;
+		auto cache = [&](std::size_t index)
+		{ return cache_slices ? &caches[axis][index] : nullptr; };
+
+		if (std::size_t batch = lanes[axis])
+		{
+			std::vector<prec_t> stack(w * h * batch);
+
+			for (; start + batch <= end; start += batch)
+			{
+				mask::rect r;
+				for (std::size_t i = start; i < start + batch; ++i)
+					r = mask::unite(r, axis_rects[i]);
+				if (r.empty())
+					continue;
+
+				{
+					trace::scope gather("gather");
+					slices::get_interleaved(work, start, batch, axis, batch, r.u0, r.v0, r.width, r.height, stack.data());
+				}
+				{
+					trace::scope step("step");
+					for (std::size_t s = 0; s < steps; ++s)
+						slice_filters[id]->StepBatch(stack.data(), r.width, r.height, cache(start));
+				}
+				{
+					trace::scope scatter("scatter");
+					slices::set_interleaved(work, stack.data(), start, batch, axis, batch, r.u0, r.v0, r.width, r.height);
+				}
+				done += r.area() * batch;
+			}
+		}
+
+		auto step = [&](i3d::Image3d<prec_t> &slice, std::size_t index)
+		{
+			trace::scope scope("step");
+			for (std::size_t s = 0; s < steps; ++s)
+				slice_filters[id]->StepWith(slice, cache(index), intra_slice[axis] ? &split : nullptr);
+		};
+
+		// Runs of non-empty slices are gathered together, partial rectangles are cropped
+		while (start < end)
+		{
+			for (; start < end && axis_rects[start].empty(); ++start)
+				;
+			std::size_t run_end = start;
+			for (; run_end < end && !axis_rects[run_end].empty(); ++run_end)
+				;
+			if (start == run_end)
+				break;
+
+			std::vector<i3d::Image3d<prec_t>> slices;
+			{
+				trace::scope gather("gather");
+				slices = get_slices(work, start, run_end, axis);
+			}
+
+			for (std::size_t i = start; i < run_end; ++i)
+			{
+				auto &slice = slices[i - start];
+				const mask::rect &r = axis_rects[i];
+
+				if (r.area() == w * h)
+					step(slice, i);
+				else
+				{
+					i3d::Image3d<prec_t> part;
+					slices::crop(slice, part, r.u0, r.v0, r.width, r.height);
+					step(part, i);
+					slices::paste(slice, part, r.u0, r.v0);
+				}
+				done += r.area();
+			}
+
+			{
+				trace::scope scatter("scatter");
+				set_slices(work, slices, start, run_end, axis);
+			}
+			start = run_end;
+		}
+
+		processed += done;
+		total += w * h * (end - first);
+	};
+
+	for (std::size_t it = 1; it <= iters; it += steps)
+	{
+		steps = std::min(inner_iters, iters - it + 1);
+		if (steps == 1)
+			print(fmt::format("Starting iteration {}", it));
+		else
+			print(fmt::format("Starting iterations {} - {}", it, it + steps - 1));
+
+		for (std::size_t axis = 0; axis < 3; ++axis)
+		{
+			// one job per slice when the slices are split, otherwise one per thread
+			std::size_t jobs = intra_slice[axis] ? work.GetSize()[axis] : thread_count;
+
+			print(fmt::format("\tProcessing axis {}{}", axis, intra_slice[axis] ? " (intra-slice)" : ""));
+
+			std::string phase = fmt::format("axis {}", axis);
+			perf::phase measure(phase, work.GetImageSize());
+			memory::phase account(phase);
+			threads.parallel_for(jobs, [&](std::size_t t)
+								 { worker(t, axis, jobs); });
+		}
+
+		on_iteration(it + steps - 1);
+	}
+
+	if (cache_slices)
+	{
+		std::size_t bytes = 0, stepped = 0, refreshed = 0;
+		for (const auto &axis_caches : caches)
+			for (const auto &c : axis_caches)
+			{
+				bytes += c.bytes();
+				stepped += c.steps();
+				refreshed += c.refreshes();
+			}
+		print(fmt::format("Recomputed {} of {} cached diffusion tensors ( {:.1f} %, a batch counts once ), "
+						  "cache {:.1f} MiB",
+						  refreshed, stepped, 100.0 * double(refreshed) / double(std::max<std::size_t>(stepped, 1)),
+						  double(bytes) / double(1 << 20)));
+	}
+
+	return {processed, total};
+}
+
+/*
+ * Runs 'iters' iterations on a grid downsampled by 'po_pyramid_scale', with distances scaled
+ * by 1 / scale and time by 1 / scale^2 so they cover the same diffusion as at full resolution.
+ * Only the change the coarse run made is upsampled and added, so the fine detail of 'work'
+ * that the coarse grid cannot represent is kept.
+ */
+template <typename prec_t>
+void run_coarse(pool::thread_pool &threads, std::size_t thread_count, i3d::Image3d<prec_t> &work, std::size_t iters)
+{
+	double scale = double(po_pyramid_scale);
+	auto shrink = [](std::size_t n)
+	{ return std::max<std::size_t>(1, (n + po_pyramid_scale - 1) / po_pyramid_scale); };
+
+	i3d::Vector3d<std::size_t> size = work.GetSize();
+	i3d::Vector3d<std::size_t> coarse_size(shrink(size.x), shrink(size.y), shrink(size.z));
+
+	i3d::Image3d<prec_t> coarse, change;
+	i3d::Resample(work, coarse, coarse_size, i3d::LANCZOS);
+	std::vector<prec_t> before(coarse.GetFirstVoxelAddr(), coarse.GetFirstVoxelAddr() + coarse.GetImageSize());
+
+	print(fmt::format("Running {} iterations at 1/{} resolution", iters, po_pyramid_scale));
+	filters::params params{po_sigma / scale, po_rho / scale, po_tau / (scale * scale), po_lambda,
+						   get_gauss_backend(), get_refresh_policy()};
+	run_filter(threads, thread_count, coarse, params, iters, po_inner_iters,
+			   mask::full_rects(coarse_size.x, coarse_size.y, coarse_size.z), [](std::size_t) {});
+
+	prec_t *c = coarse.GetFirstVoxelAddr();
+	for (std::size_t i = 0; i < before.size(); ++i)
+		c[i] -= before[i];
+
+	i3d::Resample(coarse, change, size, i3d::LANCZOS);
+
+	prec_t *w = work.GetFirstVoxelAddr();
+	const prec_t *d = change.GetFirstVoxelAddr();
+	for (std::size_t i = 0; i < work.GetImageSize(); ++i)
+		w[i] += d[i];
+}
+
+// Per phase IPC and misses per voxel, LLC misses are counted as 64 byte lines of DRAM traffic
+void print_perf_counters()
+{
+	auto &counters = perf::registry::instance();
+	if (!counters.available())
+		return;
+
+	auto show = [&](perf::counter c, double value, const char *unit)
+	{ return counters.has(c) ? fmt::format("{:.3f} {}", value, unit) : fmt::format("n/a {}", unit); };
+
+	print("Performance counters:");
+	for (const auto &p : counters.phases())
+	{
+		double voxels = double(std::max<std::size_t>(p.voxels, 1));
+		double ipc = p.counts[perf::cycles] > 0 ? p.counts[perf::instructions] / p.counts[perf::cycles] : 0.0;
+		double traffic = p.counts[perf::llc_misses] * 64.0 / std::max(p.seconds, 1e-9) * 1e-9;
+
+		print(fmt::format("	{}: {:.3f} s, {}, {}, {}, {}", p.name, p.seconds,
+						  show(perf::instructions, ipc, "IPC"),
+						  show(perf::llc_misses, p.counts[perf::llc_misses] / voxels, "LLC misses/voxel"),
+						  show(perf::dtlb_misses, p.counts[perf::dtlb_misses] / voxels, "dTLB misses/voxel"),
+						  show(perf::llc_misses, traffic, "GB/s DRAM")));
+	}
+}
+
+// The filter settings as attributes of HDF5 output, 'w' is a series writer or a frames sink
+template <typename W>
+void write_run_attributes(W &w)
+{
+	w.attribute("filter", po_filter);
+	w.attribute("sigma", po_sigma);
+	w.attribute("rho", po_rho);
+	w.attribute("tau", po_tau);
+	w.attribute("lambda", po_lambda);
+	w.attribute("iters", double(po_iters));
+	w.attribute("inner_iters", double(po_inner_iters));
+	w.attribute("tensor_refresh", double(po_tensor_refresh));
+	w.attribute("tensor_threshold", po_tensor_threshold);
+	w.attribute("save_every", double(po_save_every));
+	w.attribute("backend", po_backend);
+	w.attribute("gauss", po_gauss);
+	w.attribute("precision", po_precision);
+}
+
+// Per phase time and memory, the overall peak is also given per voxel of the working image
+void print_profile(std::size_t voxels)
+{
+	constexpr double mib = 1024.0 * 1024.0;
+	std::size_t peak_rss = 0;
+
+	print("Profile:");
+	for (const auto &p : memory::registry::instance().phases())
+	{
+		print(fmt::format("\t{}: {:.3f} s, {} allocations, {:.1f} MiB allocated, peak heap {:.1f} MiB, peak RSS {:.1f} MiB",
+						  p.name, p.seconds, p.allocations, p.allocated / mib, p.peak_heap / mib, p.peak_rss / mib));
+		peak_rss = std::max(peak_rss, p.peak_rss);
+	}
+
+	print(fmt::format("\tPeak RSS {:.1f} MiB, {:.1f} bytes per voxel", peak_rss / mib,
+					  double(peak_rss) / double(std::max<std::size_t>(voxels, 1))));
+}
+
+/*
+ * Runs every (frame, channel) volume of 'source' through the 3D pipeline. Each volume gets
+ * 'frame_threads' jobs per axis and the pool's other threads run further volumes at the same
+ * time, so small volumes run side by side and large ones use the whole pool. Snapshots,
+ * pasting and the pyramid reference are single volume features.
+ */
 template <typename img_t, typename prec_t>
-void process_image()
+void process_frames(pool::thread_pool &threads, const frames::source &source)
+{
+	if (po_save_every != 0 || po_voi_paste || po_pyramid_reference || po_inner_reference || po_tensor_reference)
+		throw std::invalid_argument("--save_every, --voi_paste and the --*_reference options need a single volume input");
+
+	const i3d::ImageHeader &header = source.header();
+	voi_regions regions = get_voi_regions(header.size);
+	const i3d::VOI<i3d::PIXELS> *read_region = po_voi.empty() ? nullptr : &regions.read_voi;
+	const i3d::VOI<i3d::PIXELS> *write_region = po_voi.empty() ? nullptr : &regions.inner;
+	auto read_size = read_region ? regions.read_voi.size : header.size;
+	auto out_size = read_region ? regions.voi.size : header.size;
+	std::size_t voxels = read_size.x * read_size.y * read_size.z;
+
+	// Below 'voxels_per_thread' a volume gets fewer threads, phases of --profile and
+	// --perf_counters are process wide and must not overlap
+	constexpr std::size_t voxels_per_thread = std::size_t(1) << 21;
+	std::size_t frame_threads = po_frame_threads != 0 ? std::min(po_frame_threads, po_threads)
+													  : std::clamp<std::size_t>(voxels / voxels_per_thread, 1, po_threads);
+	if (po_profile || po_perf_counters)
+		frame_threads = po_threads;
+
+	std::size_t count = source.frames() * source.channels();
+	std::size_t concurrent = std::min(count, po_threads / frame_threads);
+	print(fmt::format("\tFrames: {}, channels: {}, {} at a time with {} threads each",
+					  source.frames(), source.channels(), concurrent, frame_threads));
+
+	frames::sink<img_t> sink(po_output_file, source, out_size.x, out_size.y, out_size.z, po_compression_level,
+							 header.resolution.GetRes());
+	write_run_attributes(sink);
+
+	auto parallel_for = [&threads](std::size_t count, auto &&fn)
+	{ threads.parallel_for(count, fn); };
+
+	filters::params params{po_sigma, po_rho, po_tau, po_lambda, get_gauss_backend(), get_refresh_policy()};
+	std::size_t coarse_iters = std::min(po_pyramid, po_iters);
+	std::atomic<std::size_t> next = 0;
+
+	threads.parallel_for(concurrent, [&](std::size_t)
+						 {
+							 for (std::size_t i = next++; i < count; i = next++)
+							 {
+								 std::size_t t = i / source.channels(), c = i % source.channels();
+								 i3d::Image3d<prec_t> work;
+								 {
+									 trace::scope scope("load", "io");
+									 perf::phase measure("load", voxels);
+									 memory::phase account("load");
+									 source.read<img_t>(t, c, work, read_region, parallel_for, frame_threads);
+								 }
+
+								 auto rects = mask::full_rects(work.GetSizeX(), work.GetSizeY(), work.GetSizeZ());
+								 if (po_masked)
+									 rects = mask::slice_rects(get_foreground(work, read_region),
+															   work.GetSizeX(), work.GetSizeY(), work.GetSizeZ(),
+															   get_mask_margin());
+
+								 if (coarse_iters > 0)
+									 run_coarse(threads, frame_threads, work, coarse_iters);
+								 run_filter(threads, frame_threads, work, params, po_iters - coarse_iters,
+											po_inner_iters, rects, [](std::size_t) {});
+
+								 trace::scope scope("save", "io");
+								 perf::phase measure("save", work.GetImageSize());
+								 memory::phase account("save");
+								 work.SetResolution(header.resolution);
+								 work.SetOffset(header.offset);
+								 i3d::Image3d<img_t> img;
+								 sink.write(as_type(img, work), write_region, t, c, parallel_for);
+								 print(fmt::format("Saved frame {}, channel {}", t, c));
+							 }
+						 });
+
+	if (po_perf_counters)
+		print_perf_counters();
+
+	if (po_profile)
+		print_profile(voxels);
+}
+
+/*
+ * Filters the input, 'source' is its multi-frame source if it has several volumes and 'pages'
+ * the page index of a single volume TIFF, as 'main' found them.
+ */
+template <typename img_t, typename prec_t>
+void process_image(const frames::source *source, const std::vector<tiff_io::page_ref> &pages)
 {
 	// Print argument info
 	print("Running algorithm, options:");
 	print(fmt::format(
-		"\tThreads: {}\n\tPrecision: {}\n\tSigma: {}\n\tRho: {}\n\tTau: "
-		"{}\n\tIters: {}",
-		po_threads, po_precision, po_sigma, po_rho, po_tau, po_iters));
+		"\tThreads: {}\n\tPrecision: {}\n\tFilter: {}\n\tBackend: {}\n\tSigma: {}\n\tRho: "
+		"{}\n\tTau: {}\n\tLambda: {}\n\tIters: {}\n\tInner iters: {}",
+		po_threads, po_precision, po_filter, po_backend, po_sigma, po_rho, po_tau,
+		po_lambda, po_iters, po_inner_iters));
+
+	// Stepping a slice k times before the other axes see the change splits the operator into
+	// passes of k iterations per axis instead of one, with k times fewer gathers and scatters
+	if (po_inner_iters > 1)
+		print(fmt::format("\t{} iterations per slice and gather: {} passes over the volume instead of {}, "
+						  "the axes see each other's changes every {} iterations instead of every one",
+						  po_inner_iters, (po_iters + po_inner_iters - 1) / po_inner_iters, po_iters,
+						  po_inner_iters));
+
+	if (get_refresh_policy().caching())
+		print(fmt::format("\tTensor refresh: every {} steps ( 0: on change only ), threshold {}",
+						  po_tensor_refresh, po_tensor_threshold));
+
+	pool::thread_pool threads(po_threads);
+	if (po_perf_counters)
+	{
+		perf::registry::instance().enable();
+		threads.for_each_thread([]
+								{ perf::registry::instance().attach(); });
+		if (!perf::registry::instance().available())
+			print("Performance counters are not available ( see /proc/sys/kernel/perf_event_paranoid )");
+	}
+
+	// Hyperstacks, HDF5 datasets and multi-channel ICS run volume by volume
+	if (source)
+	{
+		process_frames<img_t, prec_t>(threads, *source);
+		return;
+	}
+
+	// Files of the input, one per slice of a sequence unless they are streamed TIFFs
+	std::vector<std::string> files = {po_input_file};
+	if (po_sequence)
+		i3d::SequenceReader(po_input_file.c_str()).GetFileNames(files);
+	if (files.empty())
+		throw std::invalid_argument("Input sequence matches no files");
+
+	auto parallel_for = [&threads](std::size_t count, auto &&fn)
+	{ threads.parallel_for(count, fn); };
+
+	bool zarr_input = zarr_io::is_store(po_input_file);
+	bool mapped_input = !po_sequence && metaio_io::can_map(po_input_file);
+	bool tiff_input = !zarr_input && !mapped_input && tiff_io::can_stream(files);
+	bool streamed = zarr_input || mapped_input || tiff_input;
+
+	// A streamed TIFF sequence may hold several pages per file, its depth is the number of pages
+	std::vector<tiff_io::page_ref> sequence_pages;
+	if (po_sequence && tiff_input)
+		sequence_pages = tiff_io::index_pages(files, parallel_for);
+	const auto &tiff_pages = po_sequence ? sequence_pages : pages;
+
+	auto header = zarr_input ? zarr_io::read_header(po_input_file) : i3d::ReadImageHeader(files.front().c_str());
+	if (po_sequence)
+		header.size.z = tiff_input ? sequence_pages.size() : files.size();
 
-	// Run algorithm
-	i3d::Image3d<img_t> img(po_input_file.c_str());
+	// Only the VOI and its halo are read
+	voi_regions regions = get_voi_regions(header.size);
+	const auto &voi = regions.voi, &read_voi = regions.read_voi, &inner = regions.inner;
+
+	// Run algorithm, Zarr, TIFF and uncompressed MetaImage input is decoded in parallel straight into 'work',
+	// other formats go through 'img' unless the input type is the precision type, then 'work' is
+	// read and saved directly
+	const i3d::VOI<i3d::PIXELS> *read_region = po_voi.empty() ? nullptr : &read_voi;
+	i3d::Image3d<img_t> img;
 	i3d::Image3d<prec_t> work;
-	copy(work, img);
+	{
+		auto read_size = read_region ? read_voi.size : header.size;
+		trace::scope scope("load", "io");
+		perf::phase measure("load", read_size.x * read_size.y * read_size.z);
+		memory::phase account("load");
+		if (zarr_input)
+			zarr_io::read(po_input_file, work, read_region, parallel_for);
+		else if (mapped_input)
+			metaio_io::read(po_input_file, work, read_region, parallel_for);
+		else if (streamed)
+			if (tiff_pages.empty())
+				tiff_io::read(files, work, read_region, parallel_for, po_threads);
+			else
+				tiff_io::read_pages(files, tiff_pages, work, read_region, parallel_for, po_threads);
+		else if constexpr (std::is_same_v<img_t, prec_t>)
+			work.ReadImage(po_input_file.c_str(), read_region, po_sequence);
+		else
+			img.ReadImage(po_input_file.c_str(), read_region, po_sequence);
+	}
 
-	auto worker = [&work](std::size_t id, std::size_t axis, std::size_t thread_count)
+	if (streamed)
+	{
+		work.SetResolution(header.resolution);
+		work.SetOffset(header.offset);
+	}
+	else if constexpr (!std::is_same_v<img_t, prec_t>)
 	{
-		auto [start, end] = get_job_range(id, thread_count, work.GetSize()[axis]);
-		auto slices = get_slices(work, start, end, axis);
+		memory::phase account("convert");
+		copy(work, img);
+		work.SetResolution(img.GetResolution());
+		work.SetOffset(img.GetOffset());
+	}
 
-		for (auto &slice : slices)
-			i3d::CED_AOS(slice, prec_t(po_sigma), prec_t(po_rho), prec_t(po_tau), 1ul);
+	// Part of every slice that is filtered, slices with an empty rectangle are skipped
+	auto rects = mask::full_rects(work.GetSizeX(), work.GetSizeY(), work.GetSizeZ());
+	if (po_masked)
+		rects = mask::slice_rects(get_foreground(work, read_region),
+								  work.GetSizeX(), work.GetSizeY(), work.GetSizeZ(),
+								  get_mask_margin());
 
-		set_slices(work, slices, start, end, axis);
+	// Zarr and TIFF output is compressed in parallel, HDF5 output keeps all snapshots and the result
+	// as frames of one "/ced" series, other formats are written by i3d
+	std::optional<hdf5_io::series_writer<img_t>> series;
+	auto save_image = [&](const i3d::Image3d<img_t> &image, const std::string &path,
+						  const i3d::VOI<i3d::PIXELS> *region, std::size_t it)
+	{
+		if (hdf5_io::has_hdf5_extension(path))
+		{
+			if (!series)
+			{
+				auto size = region ? region->size : image.GetSize();
+				series.emplace(path.c_str(), "/ced", size.x, size.y, size.z, po_compression_level);
+				series->resolution(image.GetResolution().GetRes());
+				write_run_attributes(*series);
+			}
+			series->write(image, region, it, parallel_for);
+		}
+		else if (zarr_io::has_zarr_extension(path))
+			zarr_io::write(path, image, region, po_compression_level, parallel_for);
+		else if (tiff_io::has_tiff_extension(path))
+			tiff_io::write(path.c_str(), image, region, po_compression_level, parallel_for);
+		else
+			image.SaveImage(path.c_str(), i3d::IMG_UNKNOWN, po_compression_level != 0, region);
 	};
 
-	for (std::size_t it = 1; it <= po_iters; ++it)
+	// Whole image, the cropped VOI or the VOI pasted into the full input
+	std::optional<i3d::Image3d<img_t>> full;
+	auto save = [&](const std::string &path, std::size_t it)
 	{
-		print(fmt::format("Starting iteration {}", it));
+		trace::scope scope("save", "io");
+		perf::phase measure("save", work.GetImageSize());
+		memory::phase account("save");
+		const i3d::Image3d<img_t> &result = as_type(img, work);
 
-		for (std::size_t axis = 0; axis < 3; ++axis)
+		if (po_voi.empty())
+			save_image(result, path, nullptr, it);
+		else if (!po_voi_paste)
+			save_image(result, path, &inner, it);
+		else
 		{
-			std::vector<std::thread> threads;
-			threads.reserve(po_threads);
+			if (!full && zarr_input)
+			{
+				zarr_io::read(po_input_file, full.emplace(), nullptr, parallel_for);
+				full->SetResolution(header.resolution);
+				full->SetOffset(header.offset);
+			}
+			else if (!full)
+				full.emplace(po_input_file.c_str(), nullptr, po_sequence);
+
+			for (std::size_t z = 0; z < voi.size.z; ++z)
+				for (std::size_t y = 0; y < voi.size.y; ++y)
+					for (std::size_t x = 0; x < voi.size.x; ++x)
+						full->SetVoxel(voi.offset.x + x, voi.offset.y + y, voi.offset.z + z,
+									   result.GetVoxel(inner.offset.x + x, inner.offset.y + y, inner.offset.z + z));
+
+			save_image(*full, path, nullptr, it);
+		}
+	};
 
-			print(fmt::format("\tProcessing axis {}", axis));
+	// The first 'pyramid' iterations run on the coarse grid, optionally a full resolution
+	// reference run is compared against the result
+	std::size_t coarse_iters = std::min(po_pyramid, po_iters);
+	std::optional<i3d::Image3d<prec_t>> reference;
+	if (coarse_iters > 0)
+	{
+		if (po_pyramid_reference)
+			reference.emplace(work);
+		run_coarse(threads, po_threads, work, coarse_iters);
+	}
 
-			for (std::size_t t = 0; t < po_threads; ++t)
-				threads.emplace_back(worker, t, axis, po_threads);
+	// Optionally the same iterations with strict interleaving or without the tensor cache are
+	// compared against the result
+	std::optional<i3d::Image3d<prec_t>> strict, uncached;
+	if (po_inner_reference)
+		strict.emplace(work);
+	if (po_tensor_reference)
+		uncached.emplace(work);
 
-			for (auto &thread : threads)
-				thread.join();
+	// Iterations are numbered across both phases
+	auto save_iteration = [&](std::size_t it)
+	{
+		it += coarse_iters;
+		if (po_save_every == 0 || it % po_save_every != 0 || it == po_iters)
+			return;
+
+		if (hdf5_io::has_hdf5_extension(po_output_file))
+		{
+			print(fmt::format("Saving iteration: {} to {}", it, po_output_file.c_str()));
+			save(po_output_file, it);
 		}
-		if (po_save_every != 0 && it % po_save_every == 0 && it != po_iters)
+		else
 		{
 			std::string new_path = po_output_file;
 			std::string extension = new_path.substr(new_path.rfind('.'));
@@ -237,40 +1171,144 @@ void process_image()
 			new_path += extension;
 
 			print(fmt::format("Saving iteration: {}", new_path.c_str()));
-			copy(img, work);
-			img.SaveImage(new_path.c_str());
+			save(new_path, it);
 		}
+	};
+
+	filters::params params{po_sigma, po_rho, po_tau, po_lambda, get_gauss_backend(), get_refresh_policy()};
+	auto [processed, total] = run_filter(threads, po_threads, work, params, po_iters - coarse_iters, po_inner_iters,
+										 rects, save_iteration);
+
+	if (po_masked)
+		print(fmt::format("Skipped {:.1f} % of the slice work",
+						  100.0 * double(total - processed) / double(std::max<std::size_t>(total, 1))));
+
+	if (reference)
+	{
+		print("Running full resolution reference");
+		run_filter(threads, po_threads, *reference, params, po_iters, po_inner_iters, rects, [](std::size_t) {});
+
+		auto diff = quality::compare(reference->GetFirstVoxelAddr(), work.GetFirstVoxelAddr(), work.GetImageSize());
+		print(fmt::format("Pyramid vs full resolution: max abs {:.4g}, RMSE {:.4g}, PSNR {:.2f} dB",
+						  diff.max_abs, diff.rmse, diff.psnr));
+	}
+
+	if (strict)
+	{
+		print("Running strictly interleaved reference");
+		run_filter(threads, po_threads, *strict, params, po_iters - coarse_iters, 1, rects, [](std::size_t) {});
+
+		auto diff = quality::compare(strict->GetFirstVoxelAddr(), work.GetFirstVoxelAddr(), work.GetImageSize());
+		print(fmt::format("Inner iters {} vs strict interleaving: max abs {:.4g}, RMSE {:.4g}, PSNR {:.2f} dB",
+						  po_inner_iters, diff.max_abs, diff.rmse, diff.psnr));
+	}
+
+	if (uncached)
+	{
+		print("Running reference without the tensor cache");
+		filters::params exact = params;
+		exact.refresh = ced::refresh_policy();
+		run_filter(threads, po_threads, *uncached, exact, po_iters - coarse_iters, po_inner_iters, rects,
+				   [](std::size_t) {});
+
+		auto diff = quality::compare(uncached->GetFirstVoxelAddr(), work.GetFirstVoxelAddr(), work.GetImageSize());
+		print(fmt::format("Tensor cache vs recomputing every step: max abs {:.4g}, RMSE {:.4g}, PSNR {:.2f} dB",
+						  diff.max_abs, diff.rmse, diff.psnr));
 	}
 
 	print(fmt::format("Saving result: {}", po_output_file.c_str()));
-	copy(img, work);
-	img.SaveImage(po_output_file.c_str());
+	save(po_output_file, po_iters);
+
+	if (po_perf_counters)
+		print_perf_counters();
+
+	if (po_profile)
+		print_profile(work.GetImageSize());
+}
+
+// The --image_format choice for the voxel type of the input ('source' if it has several volumes),
+// 32 bit integers are read as double, which holds them exactly, other types without one as float
+std::string detect_image_format(const frames::source *source)
+{
+	i3d::ImgVoxelType type = i3d::UnknownVoxel;
+	if (source)
+		type = source->header().type;
+	else if (!po_sequence && zarr_io::is_store(po_input_file))
+		type = zarr_io::read_header(po_input_file).type;
+	else
+	{
+		std::vector<std::string> files = {po_input_file};
+		if (po_sequence)
+			i3d::SequenceReader(po_input_file.c_str()).GetFileNames(files);
+		if (!files.empty())
+			type = i3d::ReadImageType(files.front().c_str());
+	}
+
+	switch (type)
+	{
+	case i3d::BinaryVoxel:
+	case i3d::Gray8Voxel:
+	case i3d::RGBVoxel:
+		return "uint8"s;
+	case i3d::Gray16Voxel:
+	case i3d::RGB16Voxel:
+		return "uint16"s;
+	case i3d::IntegerVoxel:
+	case i3d::DoubleVoxel:
+		return "double"s;
+	case i3d::UnknownVoxel:
+		throw std::runtime_error("Cannot detect the voxel type of " + po_input_file + ", set --image_format");
+	default:
+		return "float"s;
+	}
 }
 
 int main(int argc, const char **argv)
 {
 	parse_args(argc, argv);
 
+	// The input is opened once, a multi-frame source or the page index of a TIFF is passed on
+	std::optional<frames::source> source;
+	std::vector<tiff_io::page_ref> pages;
+	if (!po_sequence)
+		source = frames::source::open(po_input_file, po_dataset, &pages);
+	const frames::source *input = source ? &*source : nullptr;
+
+	if (po_image_format == "auto"s)
+	{
+		po_image_format = detect_image_format(input);
+		print(fmt::format("Detected image format: {}", po_image_format));
+	}
+
+	if (!po_trace.empty())
+		trace::recorder::instance().start();
+
+	if (po_profile)
+		memory::registry::instance().enable();
+
 	if (po_precision == "float")
 	{
 		if (po_image_format == "uint8")
-			process_image<i3d::GRAY8, float>();
+			process_image<i3d::GRAY8, float>(input, pages);
 		else if (po_image_format == "uint16")
-			process_image<i3d::GRAY16, float>();
+			process_image<i3d::GRAY16, float>(input, pages);
 		else if (po_image_format == "float")
-			process_image<float, float>();
+			process_image<float, float>(input, pages);
 		else if (po_image_format == "double")
-			process_image<double, float>();
+			process_image<double, float>(input, pages);
 	}
 	else if (po_precision == "double")
 	{
 		if (po_image_format == "uint8")
-			process_image<i3d::GRAY8, double>();
+			process_image<i3d::GRAY8, double>(input, pages);
 		else if (po_image_format == "uint16")
-			process_image<i3d::GRAY16, double>();
+			process_image<i3d::GRAY16, double>(input, pages);
 		else if (po_image_format == "float")
-			process_image<float, double>();
+			process_image<float, double>(input, pages);
 		else if (po_image_format == "double")
-			process_image<double, double>();
+			process_image<double, double>(input, pages);
 	}
+
+	if (!po_trace.empty() && !trace::recorder::instance().write(po_trace))
+		std::cerr << "Cannot write trace " << po_trace << std::endl;
 }
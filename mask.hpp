@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+/*
+ * Foreground masks for sparse processing.
+ *
+ * Every slice of every axis gets the bounding rectangle of its foreground, dilated by a
+ * margin in all three directions. Slices with an empty rectangle are skipped, the others
+ * are only filtered inside their rectangle. Slice 'i' of axis 0 spans (y, z), of axis 1
+ * (x, z) and of axis 2 (x, y), the same layout 'slices::get_X/Y/Z' produce.
+ */
+namespace mask
+{
+    struct rect
+    {
+        std::size_t u0 = 0, v0 = 0, width = 0, height = 0;
+
+        bool empty() const { return width == 0 || height == 0; }
+        std::size_t area() const { return width * height; }
+    };
+
+    // Smallest rectangle containing both
+    inline rect unite(const rect &a, const rect &b)
+    {
+        if (a.empty())
+            return b;
+        if (b.empty())
+            return a;
+
+        std::size_t u0 = std::min(a.u0, b.u0), v0 = std::min(a.v0, b.v0);
+        std::size_t u1 = std::max(a.u0 + a.width, b.u0 + b.width);
+        std::size_t v1 = std::max(a.v0 + a.height, b.v0 + b.height);
+        return {u0, v0, u1 - u0, v1 - v0};
+    }
+
+    // Whole slices, i.e. no mask
+    inline std::array<std::vector<rect>, 3> full_rects(std::size_t sx, std::size_t sy, std::size_t sz)
+    {
+        return {std::vector<rect>(sx, rect{0, 0, sy, sz}),
+                std::vector<rect>(sy, rect{0, 0, sx, sz}),
+                std::vector<rect>(sz, rect{0, 0, sx, sy})};
+    }
+
+    // Dilated foreground rectangles of all slices, 'foreground' is indexed like the image (x fastest)
+    inline std::array<std::vector<rect>, 3> slice_rects(const std::vector<bool> &foreground,
+                                                        std::size_t sx, std::size_t sy, std::size_t sz,
+                                                        std::size_t margin)
+    {
+        struct bounds
+        {
+            std::size_t u_min = std::numeric_limits<std::size_t>::max(), u_max = 0;
+            std::size_t v_min = std::numeric_limits<std::size_t>::max(), v_max = 0;
+
+            void add(std::size_t u, std::size_t v)
+            {
+                u_min = std::min(u_min, u);
+                u_max = std::max(u_max, u);
+                v_min = std::min(v_min, v);
+                v_max = std::max(v_max, v);
+            }
+        };
+
+        std::array<std::vector<bounds>, 3> raw = {std::vector<bounds>(sx), std::vector<bounds>(sy),
+                                                  std::vector<bounds>(sz)};
+
+        for (std::size_t z = 0, i = 0; z < sz; ++z)
+            for (std::size_t y = 0; y < sy; ++y)
+                for (std::size_t x = 0; x < sx; ++x, ++i)
+                    if (foreground[i])
+                    {
+                        raw[0][x].add(y, z);
+                        raw[1][y].add(x, z);
+                        raw[2][z].add(x, y);
+                    }
+
+        std::array<std::size_t, 3> count = {sx, sy, sz};
+        std::array<std::size_t, 3> width = {sy, sx, sx};
+        std::array<std::size_t, 3> height = {sz, sz, sy};
+        std::array<std::vector<rect>, 3> rects;
+
+        for (std::size_t axis = 0; axis < 3; ++axis)
+        {
+            rects[axis].resize(count[axis]);
+
+            for (std::size_t i = 0; i < count[axis]; ++i)
+            {
+                // Union over the neighbouring slices, then grown within the slice
+                bounds b;
+                std::size_t first = i > margin ? i - margin : 0;
+                std::size_t last = std::min(i + margin, count[axis] - 1);
+                for (std::size_t j = first; j <= last; ++j)
+                    if (raw[axis][j].u_min <= raw[axis][j].u_max)
+                    {
+                        b.add(raw[axis][j].u_min, raw[axis][j].v_min);
+                        b.add(raw[axis][j].u_max, raw[axis][j].v_max);
+                    }
+
+                if (b.u_min > b.u_max)
+                    continue;
+
+                std::size_t u0 = b.u_min > margin ? b.u_min - margin : 0;
+                std::size_t v0 = b.v_min > margin ? b.v_min - margin : 0;
+                std::size_t u1 = std::min(b.u_max + margin + 1, width[axis]);
+                std::size_t v1 = std::min(b.v_max + margin + 1, height[axis]);
+                rects[axis][i] = {u0, v0, u1 - u0, v1 - v0};
+            }
+        }
+
+        return rects;
+    }
+}
@@ -0,0 +1,224 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#if defined(__linux__)
+#include <malloc.h>
+#endif
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * Heap and resident memory accounting per phase.
+ *
+ * 'allocate' / 'release' are plain malloc / free, so blocks may be freed by code that did not
+ * allocate them (and the other way round). Once the registry is enabled they also count
+ * allocations, allocated bytes, live bytes and the peak of live bytes, with the block sizes
+ * taken from the allocator; the program's global operator new / delete are built on them.
+ * Resident memory comes from /proc/self/status, the high water mark is reset at the start of
+ * every phase through /proc/self/clear_refs so it is the peak of that phase.
+ *
+ * Linux only, elsewhere the heap is not counted and resident memory reads 0.
+ */
+namespace memory
+{
+    struct heap_counters
+    {
+        std::atomic<std::size_t> allocations{0};
+        std::atomic<std::size_t> allocated{0};
+        std::atomic<std::size_t> live{0};
+        std::atomic<std::size_t> peak{0};
+    };
+
+    // Constant initialized, so they are usable by allocations made before main
+    inline heap_counters heap;
+    inline std::atomic<bool> counting{false};
+
+    // Whether 'allocate' / 'release' can count, the program replaces operator new / delete only then
+#if defined(__linux__)
+    constexpr bool heap_accounting = true;
+
+    inline std::size_t block_size(void *p) { return malloc_usable_size(p); }
+#else
+    constexpr bool heap_accounting = false;
+
+    inline std::size_t block_size(void *) { return 0; }
+#endif
+
+    inline void *allocate(std::size_t size)
+    {
+        void *p = std::malloc(size != 0 ? size : 1);
+        if (!p || !counting.load(std::memory_order_relaxed))
+            return p;
+
+        size = block_size(p);
+        heap.allocations.fetch_add(1, std::memory_order_relaxed);
+        heap.allocated.fetch_add(size, std::memory_order_relaxed);
+        std::size_t live = heap.live.fetch_add(size, std::memory_order_relaxed) + size;
+        std::size_t peak = heap.peak.load(std::memory_order_relaxed);
+        while (live > peak && !heap.peak.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+            ;
+
+        return p;
+    }
+
+    inline void release(void *p)
+    {
+        if (!p)
+            return;
+
+        // blocks allocated before counting started are not in 'live', it stops at 0
+        if (counting.load(std::memory_order_relaxed))
+        {
+            std::size_t size = block_size(p);
+            std::size_t live = heap.live.load(std::memory_order_relaxed);
+            while (!heap.live.compare_exchange_weak(live, live - std::min(live, size), std::memory_order_relaxed))
+                ;
+        }
+        std::free(p);
+    }
+
+    // Resident set size and its high water mark in bytes
+    struct resident
+    {
+        std::size_t rss = 0;
+        std::size_t hwm = 0;
+    };
+
+    inline resident read_resident()
+    {
+        resident r;
+        std::ifstream status("/proc/self/status");
+        for (std::string line; std::getline(status, line);)
+        {
+            // "VmRSS:     1234 kB"
+            auto kilobytes = [&]
+            { return std::size_t(std::strtoull(line.c_str() + line.find(':') + 1, nullptr, 10)) * 1024; };
+
+            if (line.rfind("VmRSS:", 0) == 0)
+                r.rss = kilobytes();
+            else if (line.rfind("VmHWM:", 0) == 0)
+                r.hwm = kilobytes();
+        }
+        return r;
+    }
+
+    // Sets the high water mark back to the current RSS, false if the kernel does not support it
+    inline bool reset_hwm()
+    {
+        std::ofstream clear("/proc/self/clear_refs");
+        return bool(clear << "5" << std::flush);
+    }
+
+    struct phase_total
+    {
+        std::string name;
+        double seconds = 0.0;
+        std::size_t allocations = 0;
+        std::size_t allocated = 0;
+        std::size_t peak_heap = 0;
+        std::size_t peak_rss = 0;
+    };
+
+    class registry
+    {
+    public:
+        static registry &instance()
+        {
+            static registry r;
+            return r;
+        }
+
+        void enable()
+        {
+            m_enabled = true;
+            counting = heap_accounting;
+        }
+        bool enabled() const { return m_enabled; }
+
+        void add(const phase_total &p)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            auto total = std::find_if(m_phases.begin(), m_phases.end(), [&](const phase_total &t)
+                                      { return t.name == p.name; });
+            if (total == m_phases.end())
+            {
+                m_phases.push_back(p);
+                return;
+            }
+
+            total->seconds += p.seconds;
+            total->allocations += p.allocations;
+            total->allocated += p.allocated;
+            total->peak_heap = std::max(total->peak_heap, p.peak_heap);
+            total->peak_rss = std::max(total->peak_rss, p.peak_rss);
+        }
+
+        // Totals of every phase name, in the order the phases first ran
+        std::vector<phase_total> phases()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_phases;
+        }
+
+    private:
+        bool m_enabled = false;
+        std::mutex m_mutex;
+        std::vector<phase_total> m_phases;
+
+        registry() = default;
+    };
+
+    /*
+     * Adds the wall time, heap allocations and peak heap / resident memory of its lifetime to
+     * the phase 'name'. Phases must not overlap, the peaks are process wide.
+     */
+    class phase
+    {
+    public:
+        explicit phase(std::string name)
+            : m_active(registry::instance().enabled())
+        {
+            if (!m_active)
+                return;
+
+            m_total.name = std::move(name);
+            reset_hwm();
+            heap.peak.store(heap.live.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            m_allocations = heap.allocations.load(std::memory_order_relaxed);
+            m_allocated = heap.allocated.load(std::memory_order_relaxed);
+            m_begin = std::chrono::steady_clock::now();
+        }
+
+        ~phase()
+        {
+            if (!m_active)
+                return;
+
+            std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - m_begin;
+            m_total.seconds = seconds.count();
+            m_total.allocations = heap.allocations.load(std::memory_order_relaxed) - m_allocations;
+            m_total.allocated = heap.allocated.load(std::memory_order_relaxed) - m_allocated;
+            m_total.peak_heap = heap.peak.load(std::memory_order_relaxed);
+            m_total.peak_rss = read_resident().hwm;
+            registry::instance().add(m_total);
+        }
+
+        phase(const phase &) = delete;
+        phase &operator=(const phase &) = delete;
+
+    private:
+        bool m_active;
+        phase_total m_total;
+        std::size_t m_allocations = 0;
+        std::size_t m_allocated = 0;
+        std::chrono::steady_clock::time_point m_begin;
+    };
+}
@@ -0,0 +1,328 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <i3d/image3d.h>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Memory-mapped MetaImage input.
+ *
+ * The payload of an uncompressed little endian .mhd / .mha volume is mapped read-only and
+ * converted straight from the mapping into the working buffer, slices in parallel, so the
+ * file is neither copied into an intermediate image nor read through a stream. Only the
+ * pages holding the requested VOI are touched. Compressed, big endian, multi-channel and
+ * file-list volumes go through i3d.
+ */
+namespace metaio_io
+{
+    namespace fs = std::filesystem;
+
+    // Layout of a MetaImage volume, sizes are (x, y, z)
+    struct volume_info
+    {
+        std::array<std::size_t, 3> size{1, 1, 1};
+        char kind = 0;
+        std::size_t bytes = 0;
+        fs::path data_file;
+        std::size_t data_offset = 0;
+        bool mappable = false;
+    };
+
+    inline bool has_metaio_extension(const std::string &fname)
+    {
+        std::string ext = fname.substr(std::min(fname.size(), fname.rfind('.')));
+        std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c)
+                       { return char(std::tolower(c)); });
+        return ext == ".mhd" || ext == ".mha";
+    }
+
+    // Parses the header of 'fname', 'mappable' is set if the payload can be used as it is
+    inline volume_info read_info(const std::string &fname)
+    {
+        std::ifstream in(fname, std::ios::binary);
+        if (!in)
+            throw std::runtime_error("Cannot open MetaImage file " + fname);
+
+        // "Key = Value" lines, ElementDataFile is the last one and LOCAL data follow it
+        std::map<std::string, std::string> fields;
+        std::size_t local_offset = 0;
+        for (std::string line; std::getline(in, line);)
+        {
+            auto eq = line.find('=');
+            if (eq == std::string::npos)
+                continue;
+
+            auto trim = [](std::string s)
+            {
+                s.erase(0, s.find_first_not_of(" \t\r"));
+                s.erase(s.find_last_not_of(" \t\r") + 1);
+                return s;
+            };
+
+            std::string key = trim(line.substr(0, eq));
+            fields[key] = trim(line.substr(eq + 1));
+            if (key == "ElementDataFile")
+            {
+                local_offset = std::size_t(in.tellg());
+                break;
+            }
+        }
+
+        auto field = [&](const char *key, const char *fallback = "")
+        {
+            auto it = fields.find(key);
+            return it == fields.end() ? std::string(fallback) : it->second;
+        };
+
+        auto flag = [&](const char *key)
+        {
+            std::string v = field(key, "False");
+            return v == "True" || v == "true" || v == "1";
+        };
+
+        volume_info info;
+
+        std::size_t dims = std::stoul(field("NDims", "0"));
+        std::istringstream sizes(field("DimSize"));
+        for (std::size_t a = 0; a < dims && a < 3; ++a)
+            sizes >> info.size[a];
+
+        static const std::map<std::string, std::pair<char, std::size_t>> types = {
+            {"MET_CHAR", {'i', 1}}, {"MET_UCHAR", {'u', 1}},
+            {"MET_SHORT", {'i', 2}}, {"MET_USHORT", {'u', 2}},
+            {"MET_INT", {'i', 4}}, {"MET_UINT", {'u', 4}},
+            {"MET_FLOAT", {'f', 4}}, {"MET_DOUBLE", {'f', 8}}};
+
+        auto type = types.find(field("ElementType"));
+        std::string data_file = field("ElementDataFile");
+        bool big_endian = flag("BinaryDataByteOrderMSB") || flag("ElementByteOrderMSB");
+
+        if (type == types.end() || !sizes || dims < 2 || dims > 3 || data_file.empty() || data_file == "LIST" ||
+            data_file.find('%') != std::string::npos || flag("CompressedData") || big_endian ||
+            std::stoul(field("ElementNumberOfChannels", "1")) != 1)
+            return info;
+
+        info.kind = type->second.first;
+        info.bytes = type->second.second;
+
+        std::size_t payload = info.size[0] * info.size[1] * info.size[2] * info.bytes;
+        long header_size = std::stol(field("HeaderSize", "0"));
+        if (data_file == "LOCAL")
+        {
+            info.data_file = fname;
+            info.data_offset = local_offset;
+        }
+        else
+        {
+            info.data_file = fs::path(fname).parent_path() / data_file;
+            info.data_offset = header_size > 0 ? std::size_t(header_size) : 0;
+        }
+
+        std::error_code error;
+        std::size_t file_size = std::size_t(fs::file_size(info.data_file, error));
+        if (error)
+            return info;
+
+        // -1 means the payload is at the end of the file, behind a header of unknown size
+        if (header_size == -1 && file_size >= payload)
+            info.data_offset = file_size - payload;
+
+        info.mappable = info.data_offset + payload <= file_size;
+        return info;
+    }
+
+    // Whether 'fname' is a MetaImage volume this reader can map
+    inline bool can_map(const std::string &fname)
+    {
+        if (!has_metaio_extension(fname))
+            return false;
+
+        try
+        {
+            return read_info(fname).mappable;
+        }
+        catch (const std::exception &)
+        {
+            return false;
+        }
+    }
+
+    // Read-only mapping of a whole file
+    class mapped_file
+    {
+    public:
+        explicit mapped_file(const fs::path &path)
+        {
+#ifdef _WIN32
+            m_file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                 FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+            LARGE_INTEGER size;
+            if (m_file == INVALID_HANDLE_VALUE || !GetFileSizeEx(m_file, &size))
+            {
+                close_file();
+                throw std::runtime_error("Cannot open " + path.string());
+            }
+
+            m_size = std::size_t(size.QuadPart);
+            m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (m_mapping)
+                m_data = static_cast<const unsigned char *>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+            m_file = ::open(path.c_str(), O_RDONLY);
+            struct stat st;
+            if (m_file < 0 || fstat(m_file, &st) != 0)
+            {
+                close_file();
+                throw std::runtime_error("Cannot open " + path.string());
+            }
+
+            m_size = std::size_t(st.st_size);
+            void *data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_file, 0);
+            if (data != MAP_FAILED)
+            {
+                m_data = static_cast<const unsigned char *>(data);
+                madvise(data, m_size, MADV_SEQUENTIAL);
+            }
+#endif
+            if (!m_data)
+            {
+                close_file();
+                throw std::runtime_error("Cannot map " + path.string());
+            }
+        }
+
+        ~mapped_file()
+        {
+#ifdef _WIN32
+            UnmapViewOfFile(m_data);
+#else
+            munmap(const_cast<unsigned char *>(m_data), m_size);
+#endif
+            close_file();
+        }
+
+        mapped_file(const mapped_file &) = delete;
+        mapped_file &operator=(const mapped_file &) = delete;
+
+        const unsigned char *data() const { return m_data; }
+        std::size_t size() const { return m_size; }
+
+    private:
+        const unsigned char *m_data = nullptr;
+        std::size_t m_size = 0;
+#ifdef _WIN32
+        HANDLE m_file = INVALID_HANDLE_VALUE;
+        HANDLE m_mapping = nullptr;
+
+        void close_file()
+        {
+            if (m_mapping)
+                CloseHandle(m_mapping);
+            if (m_file != INVALID_HANDLE_VALUE)
+                CloseHandle(m_file);
+        }
+#else
+        int m_file = -1;
+
+        void close_file()
+        {
+            if (m_file >= 0)
+                ::close(m_file);
+        }
+#endif
+    };
+
+    // Converts 'count' samples of the volume's type at 'src' to T
+    template <typename T>
+    void convert(const volume_info &info, const unsigned char *src, T *dst, std::size_t count)
+    {
+        auto cast = [&](auto *typed)
+        {
+            for (std::size_t i = 0; i < count; ++i)
+                dst[i] = T(typed[i]);
+        };
+
+        if (info.kind == 'f')
+        {
+            if (info.bytes == 4)
+                cast(reinterpret_cast<const float *>(src));
+            else
+                cast(reinterpret_cast<const double *>(src));
+        }
+        else if (info.kind == 'u')
+        {
+            if (info.bytes == 1)
+                cast(src);
+            else if (info.bytes == 2)
+                cast(reinterpret_cast<const std::uint16_t *>(src));
+            else
+                cast(reinterpret_cast<const std::uint32_t *>(src));
+        }
+        else if (info.bytes == 1)
+            cast(reinterpret_cast<const std::int8_t *>(src));
+        else if (info.bytes == 2)
+            cast(reinterpret_cast<const std::int16_t *>(src));
+        else
+            cast(reinterpret_cast<const std::int32_t *>(src));
+    }
+
+    /*
+     * Reads the volume 'fname' into 'out', restricted to 'voi' if given. 'out' gets the file
+     * voxel values converted to T, resolution and offset are not set. Every slice is converted
+     * by its own 'parallel_for' task straight from the mapped payload.
+     */
+    template <typename T, typename F>
+    void read(const std::string &fname, i3d::Image3d<T> &out, const i3d::VOI<i3d::PIXELS> *voi, F &&parallel_for)
+    {
+        volume_info info = read_info(fname);
+        if (!info.mappable)
+            throw std::runtime_error("MetaImage payload cannot be mapped");
+
+        const auto &size = info.size;
+        std::size_t x0 = 0, y0 = 0, z0 = 0, w = size[0], h = size[1], d = size[2];
+        if (voi)
+        {
+            x0 = voi->offset.x, y0 = voi->offset.y, z0 = voi->offset.z;
+            w = voi->size.x, h = voi->size.y, d = voi->size.z;
+        }
+
+        if (x0 + w > size[0] || y0 + h > size[1] || z0 + d > size[2])
+            throw std::out_of_range("VOI exceeds the MetaImage volume");
+
+        out.MakeRoom(w, h, d);
+
+        mapped_file file(info.data_file);
+        const unsigned char *payload = file.data() + info.data_offset;
+        T *data = out.GetFirstVoxelAddr();
+
+        parallel_for(d, [&](std::size_t z)
+                     {
+                         for (std::size_t y = 0; y < h; ++y)
+                             convert(info, payload + (((z0 + z) * size[1] + y0 + y) * size[0] + x0) * info.bytes,
+                                     data + (z * h + y) * w, w);
+                     });
+    }
+}
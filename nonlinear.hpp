@@ -0,0 +1,119 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+#include <i3d/image3d.h>
+
+#include "gauss.hpp"
+#include "tensor.hpp"
+#include "tridiag.hpp"
+
+/*
+ * Native 2D nonlinear isotropic diffusion with the semi-implicit AOS scheme,
+ * u_t = div(g(|grad u_sigma|^2) grad u) with a scalar diffusivity 'g'.
+ *
+ * The scheme has no mixed terms, every step is one Gaussian, one gradient pass and
+ * one tridiagonal system per row and per column (solved in SIMD batches by 'tridiag').
+ */
+namespace nonlinear
+{
+    enum class diffusivity
+    {
+        // Perona - Malik, g = 1 / (1 + s^2 / lambda^2)
+        perona_malik,
+        // Regularised total variation, g = 1 / sqrt(s^2 + lambda^2)
+        total_variation
+    };
+
+    // Replaces the squared gradient magnitudes 's' by their diffusivities
+    template <typename T>
+    void apply_diffusivity(T *s, std::size_t count, diffusivity type, T lambda)
+    {
+        T lambda2 = lambda * lambda;
+
+        if (type == diffusivity::perona_malik)
+            for (std::size_t i = 0; i < count; ++i)
+                s[i] = T(1) / (T(1) + s[i] / lambda2);
+        else
+            for (std::size_t i = 0; i < count; ++i)
+                s[i] = T(1) / std::sqrt(s[i] + lambda2);
+    }
+
+    /*
+     * Reusable stepper for 2D slices up to a given size, all temporaries are set up once
+     * in the constructor, 'Step' does not allocate.
+     */
+    template <typename PREC>
+    class NonlinearSolver2D
+    {
+    public:
+        NonlinearSolver2D(std::size_t max_width, std::size_t max_height,
+                          diffusivity type, PREC sigma, PREC lambda, PREC tau,
+                          gauss::backend smoothing = gauss::backend::fir)
+            : m_max_width(max_width), m_max_height(max_height), m_type(type),
+              m_lambda(lambda), m_tau(tau), m_sigma(smoothing, sigma)
+        {
+            if (!(lambda > PREC(0)))
+                throw std::invalid_argument("Lambda must be positive");
+
+            std::size_t count = max_width * max_height;
+            std::size_t line = std::max(max_width, max_height);
+
+            m_smooth.resize(count);
+            m_g.resize(count);
+            m_j12.resize(count);
+            m_j22.resize(count);
+            m_f.resize(count);
+            m_buffer.resize(std::max(gauss::workspace<PREC>(line, line), 4 * line * simd::lanes<PREC>));
+        }
+
+        // One iteration of the w x h row-major buffer 'u' in place
+        void Step(PREC *u, std::size_t w, std::size_t h)
+        {
+            if (w * h > m_g.size() || std::max(w, h) > std::max(m_max_width, m_max_height))
+                throw std::invalid_argument("Slice is larger than the solver was built for");
+
+            std::size_t count = w * h;
+            PREC *smooth = m_smooth.data();
+            PREC *g = m_g.data();
+            PREC *j22 = m_j22.data();
+            PREC *f = m_f.data();
+            PREC *buffer = m_buffer.data();
+
+            std::copy(u, u + count, f);
+            std::copy(u, u + count, smooth);
+            m_sigma.apply(smooth, w, h, buffer);
+
+            // |grad u_sigma|^2 = j11 + j22
+            tensor::structure_tensor(smooth, g, m_j12.data(), j22, w, h);
+            for (std::size_t i = 0; i < count; ++i)
+                g[i] += j22[i];
+            apply_diffusivity(g, count, m_type, m_lambda);
+
+            // AOS: u = 1/2 * sum over axes of (I - 2 tau A_l)^-1 f
+            std::fill(u, u + count, PREC(0));
+            tridiag::diffuse_lines(f, g, u, w, h, 1, w, PREC(2) * m_tau, PREC(0.5), buffer);
+            tridiag::diffuse_lines(f, g, u, h, w, w, 1, PREC(2) * m_tau, PREC(0.5), buffer);
+        }
+
+        // One iteration of a 2D image (size z == 1)
+        void Step(i3d::Image3d<PREC> &slice)
+        {
+            if (slice.GetSizeZ() != 1)
+                throw std::invalid_argument("Native nonlinear diffusion supports only 2D images");
+
+            Step(slice.GetFirstVoxelAddr(), slice.GetSizeX(), slice.GetSizeY());
+        }
+
+    private:
+        std::size_t m_max_width, m_max_height;
+        diffusivity m_type;
+        PREC m_lambda, m_tau;
+        gauss::filter<PREC> m_sigma;
+        std::vector<PREC> m_smooth, m_g, m_j12, m_j22, m_f, m_buffer;
+    };
+}
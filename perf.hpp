@@ -0,0 +1,215 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Hardware performance counters per phase (Linux only).
+ *
+ * Every thread that calls 'attach' gets its own set of counters, opened with perf_event_open
+ * for that thread alone and counting user space only. A 'phase' reads the counters of all
+ * attached threads when it starts and ends and adds the difference to the phase's totals.
+ * Counters the kernel refuses (perf_event_paranoid, no PMU in a VM) are left out, if none can
+ * be opened 'available' is false and phases record nothing.
+ */
+namespace perf
+{
+    enum counter
+    {
+        cycles,
+        instructions,
+        llc_misses,
+        dtlb_misses,
+        counter_count
+    };
+
+    using values = std::array<double, counter_count>;
+
+    struct phase_total
+    {
+        std::string name;
+        values counts{};
+        double seconds = 0.0;
+        std::size_t voxels = 0;
+    };
+
+    class registry
+    {
+    public:
+        static registry &instance()
+        {
+            static registry r;
+            return r;
+        }
+
+        void enable() { m_enabled = true; }
+        bool enabled() const { return m_enabled; }
+
+        bool available()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_available;
+        }
+
+        // Opens the counters of the calling thread, once per thread
+        void attach()
+        {
+            thread_local bool attached = false;
+            if (!m_enabled || attached)
+                return;
+            attached = true;
+
+            auto set = std::make_unique<thread_counters>();
+#ifdef __linux__
+            static const std::array<std::pair<std::uint32_t, std::uint64_t>, counter_count> events = {{
+                {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+                {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+                {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+                {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+            }};
+
+            for (std::size_t c = 0; c < counter_count; ++c)
+            {
+                perf_event_attr attr{};
+                attr.size = sizeof(attr);
+                attr.type = events[c].first;
+                attr.config = events[c].second;
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+                set->fds[c] = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+            }
+#endif
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (int fd : set->fds)
+                m_available = m_available || fd >= 0;
+            m_threads.push_back(std::move(set));
+        }
+
+        // Counts of all attached threads, scaled up where the kernel multiplexed a counter
+        values read()
+        {
+            values sum{};
+#ifdef __linux__
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (const auto &set : m_threads)
+                for (std::size_t c = 0; c < counter_count; ++c)
+                {
+                    std::uint64_t data[3];
+                    if (set->fds[c] < 0 || ::read(set->fds[c], data, sizeof(data)) != ssize_t(sizeof(data)) || data[2] == 0)
+                        continue;
+                    sum[c] += double(data[0]) * double(data[1]) / double(data[2]);
+                }
+#endif
+            return sum;
+        }
+
+        void add(const std::string &name, const values &counts, double seconds, std::size_t voxels)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            phase_total *total = nullptr;
+            for (auto &t : m_phases)
+                if (t.name == name)
+                    total = &t;
+            if (!total)
+                total = &m_phases.emplace_back(phase_total{name});
+
+            for (std::size_t c = 0; c < counter_count; ++c)
+                total->counts[c] += counts[c];
+            total->seconds += seconds;
+            total->voxels += voxels;
+        }
+
+        // Totals of every phase name, in the order the phases first ran
+        std::vector<phase_total> phases()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_phases;
+        }
+
+        // Whether counter 'c' could be opened on any thread
+        bool has(counter c)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (const auto &set : m_threads)
+                if (set->fds[c] >= 0)
+                    return true;
+            return false;
+        }
+
+    private:
+        struct thread_counters
+        {
+            std::array<int, counter_count> fds{-1, -1, -1, -1};
+
+            ~thread_counters()
+            {
+#ifdef __linux__
+                for (int fd : fds)
+                    if (fd >= 0)
+                        ::close(fd);
+#endif
+            }
+        };
+
+        bool m_enabled = false;
+        bool m_available = false;
+        std::mutex m_mutex;
+        std::vector<std::unique_ptr<thread_counters>> m_threads;
+        std::vector<phase_total> m_phases;
+
+        registry() = default;
+    };
+
+    // Adds the counts and wall time of its lifetime, and 'voxels' processed, to the phase 'name'
+    class phase
+    {
+    public:
+        phase(std::string name, std::size_t voxels)
+            : m_name(std::move(name)), m_voxels(voxels), m_active(registry::instance().available())
+        {
+            if (!m_active)
+                return;
+            m_begin = std::chrono::steady_clock::now();
+            m_counts = registry::instance().read();
+        }
+
+        ~phase()
+        {
+            if (!m_active)
+                return;
+
+            values end = registry::instance().read();
+            for (std::size_t c = 0; c < counter_count; ++c)
+                end[c] -= m_counts[c];
+
+            std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - m_begin;
+            registry::instance().add(m_name, end, seconds.count(), m_voxels);
+        }
+
+        phase(const phase &) = delete;
+        phase &operator=(const phase &) = delete;
+
+    private:
+        std::string m_name;
+        std::size_t m_voxels;
+        bool m_active;
+        std::chrono::steady_clock::time_point m_begin;
+        values m_counts{};
+    };
+}
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "trace.hpp"
+
+namespace pool
+{
+    /*
+     * Fixed set of worker threads that run 'parallel_for' jobs.
+     *
+     * The calling thread takes part in its own job, so 'parallel_for' may be nested (sub-slice
+     * tasks inside slice tasks) without deadlocking: every job can always be finished by its
+     * caller alone, idle workers only speed it up. Exceptions thrown by a task are rethrown
+     * by 'parallel_for' once all tasks of the job are done.
+     */
+    class thread_pool
+    {
+    public:
+        // 'threads' counts the calling thread, 'threads - 1' workers are started
+        explicit thread_pool(std::size_t threads)
+        {
+            for (std::size_t t = 1; t < threads; ++t)
+                m_workers.emplace_back([this]
+                                       { work(); });
+        }
+
+        ~thread_pool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stop = true;
+            }
+            m_wake.notify_all();
+
+            for (auto &worker : m_workers)
+                worker.join();
+        }
+
+        thread_pool(const thread_pool &) = delete;
+        thread_pool &operator=(const thread_pool &) = delete;
+
+        std::size_t size() const { return m_workers.size() + 1; }
+
+        // Calls 'fn(i)' for every i in [0, count) and returns when all calls are done
+        template <typename F>
+        void parallel_for(std::size_t count, F &&fn)
+        {
+            if (count == 0)
+                return;
+
+            auto j = std::make_shared<job>();
+            j->count = count;
+            j->fn = [&fn](std::size_t i)
+            { fn(i); };
+
+            if (count > 1 && !m_workers.empty())
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_jobs.push_back(j);
+                }
+                m_wake.notify_all();
+            }
+
+            run(*j);
+
+            // the caller waits for tasks still running on workers
+            trace::scope wait("wait", "pool");
+            std::unique_lock<std::mutex> lock(j->mutex);
+            j->finished.wait(lock, [&]
+                             { return j->done == j->count; });
+
+            if (j->error)
+                std::rethrow_exception(j->error);
+        }
+
+        /*
+         * Calls 'fn()' once on every thread of the pool, the caller included, e.g. to set up
+         * per-thread state. No other job may run at the same time.
+         */
+        template <typename F>
+        void for_each_thread(F &&fn)
+        {
+            std::atomic<std::size_t> arrived{0};
+            parallel_for(size(), [&](std::size_t)
+                         {
+                             fn();
+
+                             // a thread waits here until all have arrived, so none takes two tasks
+                             ++arrived;
+                             while (arrived.load() < size())
+                                 std::this_thread::yield();
+                         });
+        }
+
+    private:
+        struct job
+        {
+            std::size_t count = 0;
+            std::atomic<std::size_t> next{0};
+            std::function<void(std::size_t)> fn;
+
+            // guarded by 'mutex'
+            std::size_t done = 0;
+            std::exception_ptr error;
+            std::mutex mutex;
+            std::condition_variable finished;
+        };
+
+        std::vector<std::thread> m_workers;
+        std::deque<std::shared_ptr<job>> m_jobs;
+        std::mutex m_mutex;
+        std::condition_variable m_wake;
+        bool m_stop = false;
+
+        static void run(job &j)
+        {
+            std::size_t ran = 0;
+            for (std::size_t i; (i = j.next++) < j.count; ++ran)
+            {
+                try
+                {
+                    j.fn(i);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(j.mutex);
+                    if (!j.error)
+                        j.error = std::current_exception();
+                }
+            }
+
+            if (ran == 0)
+                return;
+
+            std::lock_guard<std::mutex> lock(j.mutex);
+            j.done += ran;
+            if (j.done == j.count)
+                j.finished.notify_all();
+        }
+
+        void work()
+        {
+            for (;;)
+            {
+                std::shared_ptr<job> j;
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_wake.wait(lock, [this]
+                                { return m_stop || !m_jobs.empty(); });
+                    if (m_jobs.empty())
+                        return;
+
+                    j = m_jobs.front();
+                    if (j->next >= j->count)
+                    {
+                        // all tasks handed out, the job's caller waits for the running ones
+                        m_jobs.pop_front();
+                        continue;
+                    }
+                }
+
+                run(*j);
+            }
+        }
+    };
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+#include "gauss.hpp"
+#include "tensor.hpp"
+
+/*
+ * Comparison of a result against a reference result, used to report what an approximation
+ * (e.g. the coarse-to-fine schedule) costs in quality.
+ */
+namespace quality
+{
+    struct difference
+    {
+        double max_abs = 0.0;
+        double rmse = 0.0;
+        // Relative to the value range of the reference, infinite for identical buffers
+        double psnr = std::numeric_limits<double>::infinity();
+    };
+
+    template <typename T>
+    difference compare(const T *reference, const T *result, std::size_t count)
+    {
+        difference d;
+        if (count == 0)
+            return d;
+
+        double lo = reference[0], hi = reference[0], sum = 0.0;
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            double e = double(result[i]) - double(reference[i]);
+            d.max_abs = std::max(d.max_abs, std::abs(e));
+            sum += e * e;
+            lo = std::min<double>(lo, reference[i]);
+            hi = std::max<double>(hi, reference[i]);
+        }
+
+        d.rmse = std::sqrt(sum / double(count));
+        if (d.rmse > 0.0)
+            d.psnr = 20.0 * std::log10(std::max(hi - lo, std::numeric_limits<double>::min()) / d.rmse);
+
+        return d;
+    }
+
+    /*
+     * Orientation coherence ((l1 - l2) / (l1 + l2))^2 of the structure tensor of every xy slice of
+     * the w x h x d volume 'u', pre-smoothed with 'sigma' and integrated with 'rho'. It is 0 for
+     * flat or isotropic regions and 1 for a single dominant orientation, the quantity CED enhances.
+     */
+    template <typename T>
+    std::vector<T> coherence(const T *u, std::size_t w, std::size_t h, std::size_t d, T sigma, T rho)
+    {
+        std::vector<T> c(w * h * d);
+        std::vector<T> smooth(w * h), j11(w * h), j12(w * h), j22(w * h);
+        std::vector<T> buffer(gauss::workspace<T>(w, h));
+        gauss::filter<T> pre(gauss::backend::fir, sigma), post(gauss::backend::fir, rho);
+
+        for (std::size_t z = 0; z < d; ++z)
+        {
+            std::copy_n(u + z * w * h, w * h, smooth.begin());
+            pre.apply(smooth.data(), w, h, buffer.data());
+            tensor::structure_tensor(smooth.data(), j11.data(), j12.data(), j22.data(), w, h);
+            for (auto *j : {&j11, &j12, &j22})
+                post.apply(j->data(), w, h, buffer.data());
+
+            for (std::size_t i = 0; i < w * h; ++i)
+            {
+                T trace = j11[i] + j22[i];
+                T diff = j11[i] - j22[i];
+                c[z * w * h + i] = trace > std::numeric_limits<T>::epsilon()
+                                       ? (diff * diff + T(4) * j12[i] * j12[i]) / (trace * trace)
+                                       : T(0);
+            }
+        }
+
+        return c;
+    }
+}
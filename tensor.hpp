@@ -0,0 +1,158 @@
+#pragma once
+
+#include <cstddef>
+#include <limits>
+#include <type_traits>
+
+#include "simd.hpp"
+
+/*
+ * Per-pixel tensor stages of the CED step, written on 'simd::pack' so they run
+ * at the full SIMD width of the target.
+ */
+namespace tensor
+{
+    /*
+     * Fused gradient and structure tensor pass: central differences (reflecting boundary)
+     * of 'u' and J = grad(u) * grad(u)^T stored as its three distinct components.
+     * Only rows [first_row, last_row) are written.
+     */
+    template <typename T>
+    void structure_tensor(const T *u, T *j11, T *j12, T *j22, std::size_t w, std::size_t h,
+                          std::size_t first_row, std::size_t last_row)
+    {
+        using P = simd::pack<T>;
+        const P half(T(0.5));
+
+        auto scalar = [&](std::size_t x, const T *row, const T *up, const T *down, std::size_t idx)
+        {
+            std::size_t xm = x > 0 ? x - 1 : 0;
+            std::size_t xp = x + 1 < w ? x + 1 : w - 1;
+            T gx = T(0.5) * (row[xp] - row[xm]);
+            T gy = T(0.5) * (down[x] - up[x]);
+            j11[idx] = gx * gx;
+            j12[idx] = gx * gy;
+            j22[idx] = gy * gy;
+        };
+
+        for (std::size_t y = first_row; y < last_row; ++y)
+        {
+            const T *row = u + y * w;
+            const T *up = u + (y > 0 ? y - 1 : 0) * w;
+            const T *down = u + (y + 1 < h ? y + 1 : h - 1) * w;
+            std::size_t base = y * w;
+
+            std::size_t x = 0;
+            if (w > 1)
+                scalar(x++, row, up, down, base);
+
+            for (; x + P::width < w; x += P::width)
+            {
+                P gx = half * (P::load(row + x + 1) - P::load(row + x - 1));
+                P gy = half * (P::load(down + x) - P::load(up + x));
+                (gx * gx).store(j11 + base + x);
+                (gx * gy).store(j12 + base + x);
+                (gy * gy).store(j22 + base + x);
+            }
+
+            for (; x < w; ++x)
+                scalar(x, row, up, down, base + x);
+        }
+    }
+
+    template <typename T>
+    void structure_tensor(const T *u, T *j11, T *j12, T *j22, std::size_t w, std::size_t h)
+    {
+        structure_tensor(u, j11, j12, j22, w, h, 0, h);
+    }
+
+    /*
+     * 'structure_tensor' for 'simd::lanes<T>' interleaved w x h buffers, value (x, y) of buffer 's'
+     * is stored at [(y * w + x) * lanes + s]. The packs run across the buffers, so every
+     * pixel is handled at full width regardless of the row length.
+     */
+    template <typename T>
+    void structure_tensor_interleaved(const T *u, T *j11, T *j12, T *j22, std::size_t w, std::size_t h)
+    {
+        using P = simd::pack<T>;
+        constexpr std::size_t L = simd::lanes<T>;
+        const P half(T(0.5));
+
+        for (std::size_t y = 0; y < h; ++y)
+        {
+            std::size_t ym = y > 0 ? y - 1 : 0;
+            std::size_t yp = y + 1 < h ? y + 1 : h - 1;
+
+            for (std::size_t x = 0; x < w; ++x)
+            {
+                std::size_t xm = x > 0 ? x - 1 : 0;
+                std::size_t xp = x + 1 < w ? x + 1 : w - 1;
+                std::size_t idx = (y * w + x) * L;
+
+                for (std::size_t s = 0; s < L; s += P::width)
+                {
+                    P gx = half * (P::load(u + (y * w + xp) * L + s) - P::load(u + (y * w + xm) * L + s));
+                    P gy = half * (P::load(u + (yp * w + x) * L + s) - P::load(u + (ym * w + x) * L + s));
+                    (gx * gx).store(j11 + idx + s);
+                    (gx * gy).store(j12 + idx + s);
+                    (gy * gy).store(j22 + idx + s);
+                }
+            }
+        }
+    }
+
+    /*
+     * Fused closed-form 2x2 eigen-decomposition and diffusion tensor assembly, in place.
+     *
+     * For the smoothed structure tensor with eigenvalues mu1 >= mu2 and d = mu1 - mu2, the
+     * eigenvalues of the diffusion tensor are l1 = alpha (across the structure) and
+     * l2 = alpha + (1 - alpha) * exp(-contrast / d^2) (along it). With v1 the eigenvector of mu1,
+     * D = l2 * I + (l1 - l2) * v1 * v1^T, where v1 * v1^T = 1/2 * [1 + cos, sin; sin, 1 - cos]
+     * and cos = (j11 - j22) / d, sin = 2 * j12 / d. This form needs no branches: for d == 0
+     * l1 == l2 and the direction does not matter.
+     */
+    template <typename T>
+    void diffusion_tensor(T *a, T *b, T *c, std::size_t count, T alpha, T contrast)
+    {
+        auto kernel = [alpha, contrast](auto j11, auto j12, auto j22, auto &da, auto &db, auto &dc)
+        {
+            using P = std::decay_t<decltype(j11)>;
+            const P tiny(std::numeric_limits<T>::min());
+            const P half(T(0.5));
+
+            P diff = j11 - j22;
+            P d2 = diff * diff + P(T(4)) * j12 * j12;
+            P inv_d = P(T(1)) / max(sqrt(d2), tiny);
+
+            P l1(alpha);
+            P l2 = l1 + P(T(1) - alpha) * exp(P(-contrast) / max(d2, tiny));
+            P dl = l1 - l2;
+
+            P cos2 = diff * inv_d;
+            da = l2 + half * dl * (P(T(1)) + cos2);
+            db = dl * j12 * inv_d;
+            dc = l2 + half * dl * (P(T(1)) - cos2);
+        };
+
+        using P = simd::pack<T>;
+        std::size_t i = 0;
+        for (; i + P::width <= count; i += P::width)
+        {
+            P da, db, dc;
+            kernel(P::load(a + i), P::load(b + i), P::load(c + i), da, db, dc);
+            da.store(a + i);
+            db.store(b + i);
+            dc.store(c + i);
+        }
+
+        using S = simd::scalar<T>;
+        for (; i < count; ++i)
+        {
+            S da, db, dc;
+            kernel(S(a[i]), S(b[i]), S(c[i]), da, db, dc);
+            da.store(a + i);
+            db.store(b + i);
+            dc.store(c + i);
+        }
+    }
+}
@@ -0,0 +1,554 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <i3d/image3d.h>
+#include <tiffio.h>
+
+#include "codec.hpp"
+
+/*
+ * Streaming TIFF input.
+ *
+ * Pages are decoded one strip or tile at a time and every chunk is converted straight into
+ * the working buffer, so the image is never held in memory in its file voxel type. Only the
+ * strips / tiles overlapping the requested VOI are decoded, pages (or bands of a page) are
+ * decoded in parallel. Handles single channel 8, 16 and
+ * 32 bit unsigned and 32 / 64 bit floating point pages, everything else goes through i3d.
+ *
+ * ImageJ hyperstacks (the "channels=", "slices=", "frames=" ImageDescription of the first page)
+ * are read one (frame, channel) volume at a time.
+ *
+ * Output is written as tiled (Big)TIFF whose tiles are compressed in parallel, multi-frame
+ * output as a hyperstack in ImageJ page order (channel fastest, then slice, then frame).
+ */
+namespace tiff_io
+{
+    using handle = std::unique_ptr<TIFF, decltype(&TIFFClose)>;
+
+    inline handle open(const char *fname, const char *mode = "r")
+    {
+        return handle(TIFFOpen(fname, mode), &TIFFClose);
+    }
+
+    // Layout of the current directory (page)
+    struct page_info
+    {
+        std::uint32_t width = 0, height = 0;
+        std::uint16_t bits = 0, format = SAMPLEFORMAT_UINT;
+        bool tiled = false;
+        std::uint32_t chunk_width = 0, chunk_height = 0; // tile size, or width x rows per strip
+
+        bool supported() const
+        {
+            if (format == SAMPLEFORMAT_UINT)
+                return bits == 8 || bits == 16 || bits == 32;
+            if (format == SAMPLEFORMAT_IEEEFP)
+                return bits == 32 || bits == 64;
+            return false;
+        }
+    };
+
+    inline page_info read_page_info(TIFF *tif)
+    {
+        page_info p;
+        std::uint16_t samples = 1, photometric = PHOTOMETRIC_MINISBLACK, planar = PLANARCONFIG_CONTIG;
+
+        TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &p.width);
+        TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &p.height);
+        TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &p.bits);
+        TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLEFORMAT, &p.format);
+        TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &samples);
+        TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &photometric);
+        TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar);
+
+        // Palette, inverted (MINISWHITE) and colour pages are left to i3d
+        if (samples != 1 || photometric != PHOTOMETRIC_MINISBLACK || planar != PLANARCONFIG_CONTIG)
+            p.bits = 0; // not supported
+
+        p.tiled = TIFFIsTiled(tif);
+        if (p.tiled)
+        {
+            TIFFGetField(tif, TIFFTAG_TILEWIDTH, &p.chunk_width);
+            TIFFGetField(tif, TIFFTAG_TILELENGTH, &p.chunk_height);
+        }
+        else
+        {
+            p.chunk_width = p.width;
+            TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &p.chunk_height);
+            p.chunk_height = std::min(p.chunk_height, p.height);
+        }
+
+        return p;
+    }
+
+    inline bool has_tiff_extension(const std::string &fname)
+    {
+        std::string ext = fname.substr(std::min(fname.size(), fname.rfind('.')));
+        std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c)
+                       { return char(std::tolower(c)); });
+        return ext == ".tif" || ext == ".tiff";
+    }
+
+    // Whether 'files' are TIFFs whose pages this reader can decode, only the first file is opened
+    inline bool can_stream(const std::vector<std::string> &files)
+    {
+        if (files.empty() || !std::all_of(files.begin(), files.end(), has_tiff_extension))
+            return false;
+
+        handle tif = open(files.front().c_str());
+        return tif && read_page_info(tif.get()).supported();
+    }
+
+    inline bool can_stream(const std::string &fname)
+    {
+        return can_stream(std::vector<std::string>{fname});
+    }
+
+    // Volumes of an ImageJ hyperstack, a plain multi-page TIFF is one volume of all its pages
+    struct hyperstack
+    {
+        std::size_t channels = 1, slices = 0, frames = 1;
+
+        std::size_t volumes() const { return channels * frames; }
+
+        // Page of slice 'z' of frame 't', channel 'c'
+        std::size_t page(std::size_t t, std::size_t c, std::size_t z) const { return (t * slices + z) * channels + c; }
+    };
+
+    // Layout from the ImageJ description of the first page, 'pages' is the number of pages of the file
+    inline hyperstack read_hyperstack(const std::string &fname, std::size_t pages)
+    {
+        hyperstack stack;
+        stack.slices = pages;
+
+        handle tif = open(fname.c_str());
+        char *description = nullptr;
+        if (!tif || !TIFFGetField(tif.get(), TIFFTAG_IMAGEDESCRIPTION, &description) ||
+            std::string(description).rfind("ImageJ=", 0) != 0)
+            return stack;
+
+        std::size_t channels = 1, slices = 0, frames = 1;
+        std::istringstream lines(description);
+        for (std::string line; std::getline(lines, line);)
+        {
+            auto value = [&]
+            { return std::size_t(std::strtoull(line.c_str() + line.find('=') + 1, nullptr, 10)); };
+
+            if (line.rfind("channels=", 0) == 0)
+                channels = value();
+            else if (line.rfind("slices=", 0) == 0)
+                slices = value();
+            else if (line.rfind("frames=", 0) == 0)
+                frames = value();
+        }
+
+        // without "slices=" every page that is not a channel or frame is a slice
+        if (channels == 0 || frames == 0 || pages % (channels * frames) != 0)
+            return stack;
+        if (slices == 0)
+            slices = pages / (channels * frames);
+        if (channels * slices * frames != pages)
+            return stack;
+
+        return {channels, slices, frames};
+    }
+
+    // Converts 'count' samples of the page's type at 'src' to T
+    template <typename T>
+    void convert(const page_info &p, const unsigned char *src, T *dst, std::size_t count)
+    {
+        auto cast = [&](auto *typed)
+        {
+            for (std::size_t i = 0; i < count; ++i)
+                dst[i] = T(typed[i]);
+        };
+
+        if (p.format == SAMPLEFORMAT_IEEEFP)
+        {
+            if (p.bits == 32)
+                cast(reinterpret_cast<const float *>(src));
+            else
+                cast(reinterpret_cast<const double *>(src));
+        }
+        else if (p.bits == 8)
+            cast(src);
+        else if (p.bits == 16)
+            cast(reinterpret_cast<const std::uint16_t *>(src));
+        else
+            cast(reinterpret_cast<const std::uint32_t *>(src));
+    }
+
+    /*
+     * Decodes rows [y0, y0 + h) and columns [x0, x0 + w) of the current page into 'out'
+     * (row stride 'w'). 'chunk' must hold one strip / tile.
+     */
+    template <typename T>
+    void read_page(TIFF *tif, const page_info &p,
+                   std::size_t x0, std::size_t y0, std::size_t w, std::size_t h,
+                   T *out, unsigned char *chunk)
+    {
+        std::size_t bytes = p.bits / 8;
+
+        for (std::size_t cy = y0 / p.chunk_height * p.chunk_height; cy < y0 + h; cy += p.chunk_height)
+            for (std::size_t cx = x0 / p.chunk_width * p.chunk_width; cx < x0 + w; cx += p.chunk_width)
+            {
+                tmsize_t read = p.tiled
+                                    ? TIFFReadEncodedTile(tif, TIFFComputeTile(tif, std::uint32_t(cx), std::uint32_t(cy), 0, 0), chunk, -1)
+                                    : TIFFReadEncodedStrip(tif, TIFFComputeStrip(tif, std::uint32_t(cy), 0), chunk, -1);
+                if (read < 0)
+                    throw std::runtime_error("Failed to decode TIFF data");
+
+                // overlap of the chunk and the requested region
+                std::size_t ys = std::max(cy, y0), ye = std::min({cy + p.chunk_height, y0 + h, std::size_t(p.height)});
+                std::size_t xs = std::max(cx, x0), xe = std::min({cx + p.chunk_width, x0 + w, std::size_t(p.width)});
+
+                for (std::size_t y = ys; y < ye; ++y)
+                    convert(p, chunk + ((y - cy) * p.chunk_width + (xs - cx)) * bytes,
+                            out + (y - y0) * w + (xs - x0), xe - xs);
+            }
+    }
+
+    // One page of one of the files being read
+    struct page_ref
+    {
+        std::size_t file;
+        std::uint64_t offset;
+    };
+
+    /*
+     * Directory offsets of all pages of 'files' in order, so every page can later be reached
+     * with TIFFSetSubDirectory without walking the directory chain. Files are indexed in parallel.
+     */
+    template <typename F>
+    std::vector<page_ref> index_pages(const std::vector<std::string> &files, F &&parallel_for)
+    {
+        std::vector<std::vector<std::uint64_t>> offsets(files.size());
+
+        parallel_for(files.size(), [&](std::size_t f)
+                     {
+                         handle tif = open(files[f].c_str());
+                         if (!tif)
+                             throw std::runtime_error("Cannot open TIFF file " + files[f]);
+
+                         do
+                             offsets[f].push_back(TIFFCurrentDirOffset(tif.get()));
+                         while (TIFFReadDirectory(tif.get()));
+                     });
+
+        std::vector<page_ref> pages;
+        for (std::size_t f = 0; f < files.size(); ++f)
+            for (auto offset : offsets[f])
+                pages.push_back({f, offset});
+
+        return pages;
+    }
+
+    /*
+     * Reads 'pages' of 'files' (see 'index_pages') as the slices of 'out', restricted to 'voi' if
+     * given. 'out' gets the file voxel values converted to T, resolution and offset are not set.
+     *
+     * Decoding is split into 'tasks' jobs run by 'parallel_for(count, fn)', every job has its own
+     * libtiff handle and writes straight into its part of 'out'. With at least 'tasks' pages a job
+     * decodes a range of pages, otherwise every page is split into bands of whole strips / tiles.
+     */
+    template <typename T, typename F>
+    void read_pages(const std::vector<std::string> &files, const std::vector<page_ref> &pages, i3d::Image3d<T> &out,
+                    const i3d::VOI<i3d::PIXELS> *voi, F &&parallel_for, std::size_t tasks)
+    {
+        handle tif = open(files.front().c_str());
+        if (!tif)
+            throw std::runtime_error("Cannot open TIFF file " + files.front());
+        page_info first = read_page_info(tif.get());
+        tif.reset();
+
+        std::size_t x0 = 0, y0 = 0, z0 = 0, w = first.width, h = first.height, d = pages.size();
+        if (voi)
+        {
+            x0 = voi->offset.x, y0 = voi->offset.y, z0 = voi->offset.z;
+            w = voi->size.x, h = voi->size.y, d = voi->size.z;
+        }
+
+        if (x0 + w > first.width || y0 + h > first.height || z0 + d > pages.size())
+            throw std::out_of_range("VOI exceeds the TIFF image");
+
+        out.MakeRoom(w, h, d);
+        if (d == 0 || h == 0)
+            return;
+
+        tasks = std::max<std::size_t>(tasks, 1);
+        std::size_t bands = d >= tasks ? 1 : (tasks + d - 1) / d;
+        std::size_t jobs = bands == 1 ? tasks : d * bands;
+
+        // band boundaries fall on whole chunks of the first page, so no chunk is decoded twice
+        std::size_t first_chunk = y0 / first.chunk_height;
+        std::size_t chunks = (y0 + h - 1) / first.chunk_height + 1 - first_chunk;
+        auto band_row = [&](std::size_t b)
+        {
+            std::size_t row = (first_chunk + chunks * b / bands) * first.chunk_height;
+            return std::min(std::max(row, y0), y0 + h) - y0;
+        };
+
+        parallel_for(jobs, [&](std::size_t j)
+                     {
+                         std::size_t z_begin = bands == 1 ? d * j / jobs : j / bands;
+                         std::size_t z_end = bands == 1 ? d * (j + 1) / jobs : z_begin + 1;
+                         std::size_t r0 = bands == 1 ? 0 : band_row(j % bands);
+                         std::size_t r1 = bands == 1 ? h : band_row(j % bands + 1);
+                         if (z_begin == z_end || r0 == r1)
+                             return;
+
+                         handle tif(nullptr, &TIFFClose);
+                         std::size_t open_file = files.size();
+                         std::unique_ptr<unsigned char[]> chunk;
+                         tmsize_t chunk_size = 0;
+
+                         for (std::size_t z = z_begin; z < z_end; ++z)
+                         {
+                             const page_ref &page = pages[z0 + z];
+                             if (page.file != open_file)
+                             {
+                                 tif = open(files[page.file].c_str());
+                                 open_file = page.file;
+                                 if (!tif)
+                                     throw std::runtime_error("Cannot open TIFF file " + files[page.file]);
+                             }
+
+                             if (!TIFFSetSubDirectory(tif.get(), page.offset))
+                                 throw std::runtime_error("Cannot read TIFF page");
+
+                             page_info p = read_page_info(tif.get());
+                             if (p.width != first.width || p.height != first.height || !p.supported())
+                                 throw std::runtime_error("TIFF pages differ in size or type");
+
+                             tmsize_t size = p.tiled ? TIFFTileSize(tif.get()) : TIFFStripSize(tif.get());
+                             if (size > chunk_size)
+                             {
+                                 chunk.reset(new unsigned char[std::size_t(size)]);
+                                 chunk_size = size;
+                             }
+
+                             read_page(tif.get(), p, x0, y0 + r0, w, r1 - r0,
+                                       out.GetFirstVoxelAddr() + z * w * h + r0 * w, chunk.get());
+                         }
+                     });
+    }
+
+    // Reads all pages of one multi-page TIFF or of a sequence of TIFFs, see 'read_pages'
+    template <typename T, typename F>
+    void read(const std::vector<std::string> &files, i3d::Image3d<T> &out, const i3d::VOI<i3d::PIXELS> *voi,
+              F &&parallel_for, std::size_t tasks)
+    {
+        read_pages(files, index_pages(files, parallel_for), out, voi, parallel_for, tasks);
+    }
+
+    // Reads the volume of frame 't', channel 'c' of a hyperstack whose pages are 'pages'
+    template <typename T, typename F>
+    void read_volume(const std::string &fname, const std::vector<page_ref> &pages, const hyperstack &stack,
+                     std::size_t t, std::size_t c, i3d::Image3d<T> &out, const i3d::VOI<i3d::PIXELS> *voi,
+                     F &&parallel_for, std::size_t tasks)
+    {
+        std::vector<page_ref> volume;
+        for (std::size_t z = 0; z < stack.slices; ++z)
+            volume.push_back(pages.at(stack.page(t, c, z)));
+
+        read_pages(std::vector<std::string>{fname}, volume, out, voi, parallel_for, tasks);
+    }
+
+    template <typename T>
+    void read(const char *fname, i3d::Image3d<T> &out, const i3d::VOI<i3d::PIXELS> *voi = nullptr)
+    {
+        auto sequential = [](std::size_t count, auto &&fn)
+        {
+            for (std::size_t i = 0; i < count; ++i)
+                fn(i);
+        };
+
+        read(std::vector<std::string>{fname}, out, voi, sequential, 1);
+    }
+
+    // Edge of the square output tiles, a multiple of 16 as TIFF requires
+    constexpr std::size_t tile_size = 256;
+
+    // Raw bytes kept in memory per group of pages being compressed
+    constexpr std::size_t write_group_bytes = std::size_t(256) << 20;
+
+    /*
+     * Appends 'count' w x h pages to 'tif', page 'p' starts at 'page(p)' and its rows are 'stride'
+     * values apart. Tiles are deflate-compressed at 'level' (0 stores them uncompressed) by
+     * 'parallel_for' jobs, a group of pages at a time, and written in order with TIFFWriteRawTile.
+     * Pages are numbered from 'first' of 'total', the page numbered 0 gets 'description'.
+     * Resolution is stored as pixels per centimetre.
+     */
+    template <typename T, typename P, typename F>
+    void write_pages(TIFF *tif, std::size_t count, P &&page, std::size_t stride, std::size_t w, std::size_t h,
+                     std::size_t first, std::size_t total, const i3d::Vector3d<float> &res,
+                     const std::string &description, int level, F &&parallel_for)
+    {
+        static_assert(std::is_arithmetic_v<T>, "Only scalar voxel types can be written");
+
+        std::size_t across = (w + tile_size - 1) / tile_size;
+        std::size_t down = (h + tile_size - 1) / tile_size;
+        std::size_t page_tiles = across * down;
+        std::size_t group = std::max<std::size_t>(1, write_group_bytes / std::max<std::size_t>(1, w * h * sizeof(T)));
+
+        std::vector<std::vector<unsigned char>> tiles;
+
+        for (std::size_t g0 = 0; g0 < count; g0 += group)
+        {
+            std::size_t pages = std::min(group, count - g0);
+            tiles.assign(pages * page_tiles, {});
+
+            parallel_for(tiles.size(), [&](std::size_t t)
+                         {
+                             const T *data = page(g0 + t / page_tiles);
+                             std::size_t tx = t % page_tiles % across * tile_size;
+                             std::size_t ty = t % page_tiles / across * tile_size;
+
+                             // edge tiles are padded with zeros to the full tile size
+                             std::vector<T> tile(tile_size * tile_size, T(0));
+                             for (std::size_t y = ty; y < std::min(ty + tile_size, h); ++y)
+                                 std::copy_n(data + y * stride + tx, std::min(tile_size, w - tx),
+                                             tile.data() + (y - ty) * tile_size);
+
+                             const auto *raw = reinterpret_cast<const unsigned char *>(tile.data());
+                             std::size_t raw_size = tile.size() * sizeof(T);
+                             tiles[t] = level == 0 ? std::vector<unsigned char>(raw, raw + raw_size)
+                                                   : codec::compress(raw, raw_size, level);
+                         });
+
+            for (std::size_t p = 0; p < pages; ++p)
+            {
+                std::size_t number = first + g0 + p;
+                TIFFSetField(tif, TIFFTAG_SUBFILETYPE, FILETYPE_PAGE);
+                TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, std::uint32_t(w));
+                TIFFSetField(tif, TIFFTAG_IMAGELENGTH, std::uint32_t(h));
+                TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, std::uint16_t(8 * sizeof(T)));
+                TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, std::uint16_t(1));
+                TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, std::uint16_t(std::is_floating_point_v<T> ? SAMPLEFORMAT_IEEEFP : SAMPLEFORMAT_UINT));
+                TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, std::uint16_t(PHOTOMETRIC_MINISBLACK));
+                TIFFSetField(tif, TIFFTAG_PLANARCONFIG, std::uint16_t(PLANARCONFIG_CONTIG));
+                TIFFSetField(tif, TIFFTAG_COMPRESSION, std::uint16_t(level == 0 ? COMPRESSION_NONE : COMPRESSION_ADOBE_DEFLATE));
+                TIFFSetField(tif, TIFFTAG_TILEWIDTH, std::uint32_t(tile_size));
+                TIFFSetField(tif, TIFFTAG_TILELENGTH, std::uint32_t(tile_size));
+                // PageNumber is 16 bit, larger stacks go without it rather than wrap
+                if (total <= 0xffff)
+                    TIFFSetField(tif, TIFFTAG_PAGENUMBER, std::uint16_t(number), std::uint16_t(total));
+                TIFFSetField(tif, TIFFTAG_RESOLUTIONUNIT, std::uint16_t(RESUNIT_CENTIMETER));
+                TIFFSetField(tif, TIFFTAG_XRESOLUTION, double(res.x) * 1e4);
+                TIFFSetField(tif, TIFFTAG_YRESOLUTION, double(res.y) * 1e4);
+                if (number == 0 && !description.empty())
+                    TIFFSetField(tif, TIFFTAG_IMAGEDESCRIPTION, description.c_str());
+
+                for (std::size_t i = 0; i < page_tiles; ++i)
+                {
+                    auto &tile = tiles[p * page_tiles + i];
+                    if (TIFFWriteRawTile(tif, ttile_t(i), tile.data(), tmsize_t(tile.size())) < 0)
+                        throw std::runtime_error("Failed to write TIFF tile");
+                    std::vector<unsigned char>().swap(tile);
+                }
+
+                if (!TIFFWriteDirectory(tif))
+                    throw std::runtime_error("Failed to write TIFF page");
+            }
+        }
+    }
+
+    // Writes 'img' (or just its 'voi') as a tiled TIFF, BigTIFF once the raw data reach 2 GiB
+    template <typename T, typename F>
+    void write(const char *fname, const i3d::Image3d<T> &img, const i3d::VOI<i3d::PIXELS> *voi,
+               int level, F &&parallel_for)
+    {
+        std::size_t x0 = 0, y0 = 0, z0 = 0, w = img.GetSizeX(), h = img.GetSizeY(), d = img.GetSizeZ();
+        if (voi)
+        {
+            x0 = voi->offset.x, y0 = voi->offset.y, z0 = voi->offset.z;
+            w = voi->size.x, h = voi->size.y, d = voi->size.z;
+        }
+
+        bool big = w * h * d * sizeof(T) >= (std::size_t(1) << 31);
+        handle tif = open(fname, big ? "w8" : "w");
+        if (!tif)
+            throw std::runtime_error("Cannot create TIFF file");
+
+        std::size_t sx = img.GetSizeX(), sy = img.GetSizeY();
+        auto page = [&](std::size_t p)
+        { return img.GetFirstVoxelAddr() + ((z0 + p) * sy + y0) * sx + x0; };
+
+        write_pages<T>(tif.get(), d, page, sx, w, h, 0, d, img.GetResolution().GetRes(), std::string(), level,
+                       parallel_for);
+    }
+
+    /*
+     * Multi-frame output as an ImageJ hyperstack, appended one frame (all its channels) at a time
+     * in frame order. Every channel volume is w x h x d (the size of the VOI if one is given).
+     */
+    template <typename T>
+    class hyperstack_writer
+    {
+    public:
+        hyperstack_writer(const char *fname, std::size_t w, std::size_t h, std::size_t d,
+                          std::size_t channels, std::size_t frames, int level, const i3d::Vector3d<float> &res)
+            : m_tif(nullptr, &TIFFClose), m_w(w), m_h(h), m_stack{channels, d, frames}, m_level(level), m_res(res)
+        {
+            bool big = w * h * d * channels * frames * sizeof(T) >= (std::size_t(1) << 31);
+            m_tif = open(fname, big ? "w8" : "w");
+            if (!m_tif)
+                throw std::runtime_error("Cannot create TIFF file");
+
+            std::ostringstream description;
+            description << "ImageJ=1.11a\nimages=" << channels * d * frames << "\nchannels=" << channels
+                        << "\nslices=" << d << "\nframes=" << frames << "\nhyperstack=true\nmode=grayscale\n";
+            if (res.z > 0.0f)
+                description << "unit=micron\nspacing=" << 1.0 / res.z << "\n";
+            m_description = description.str();
+        }
+
+        // Number of frames written so far
+        std::size_t frames() const { return m_frames; }
+
+        // Appends the next frame, 'channels[c]' is the volume of channel 'c'
+        template <typename F>
+        void append(const std::vector<const i3d::Image3d<T> *> &channels, const i3d::VOI<i3d::PIXELS> *voi,
+                    F &&parallel_for)
+        {
+            if (channels.size() != m_stack.channels || m_frames == m_stack.frames)
+                throw std::invalid_argument("Frame does not fit the hyperstack");
+
+            std::size_t x0 = 0, y0 = 0, z0 = 0;
+            if (voi)
+                x0 = voi->offset.x, y0 = voi->offset.y, z0 = voi->offset.z;
+
+            std::size_t sx = channels.front()->GetSizeX(), sy = channels.front()->GetSizeY();
+            auto page = [&](std::size_t p)
+            {
+                const i3d::Image3d<T> &img = *channels[p % m_stack.channels];
+                return img.GetFirstVoxelAddr() + ((z0 + p / m_stack.channels) * sy + y0) * sx + x0;
+            };
+
+            std::size_t count = m_stack.slices * m_stack.channels;
+            write_pages<T>(m_tif.get(), count, page, sx, m_w, m_h, m_frames * count, count * m_stack.frames, m_res,
+                           m_description, m_level, parallel_for);
+            ++m_frames;
+        }
+
+    private:
+        handle m_tif;
+        std::size_t m_w, m_h;
+        hyperstack m_stack;
+        int m_level;
+        i3d::Vector3d<float> m_res;
+        std::string m_description;
+        std::size_t m_frames = 0;
+    };
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * Wall clock timeline of what every thread does, written in the Chrome trace event format
+ * (chrome://tracing, Perfetto).
+ *
+ * Every thread records into its own ring buffer, so recording takes no lock; once a thread
+ * has recorded 'ring_capacity' events its oldest ones are overwritten. Buffers are merged
+ * when the trace is written, which must happen after all recording threads are done.
+ * While recording is off a 'scope' costs one relaxed load.
+ */
+namespace trace
+{
+    using clock = std::chrono::steady_clock;
+
+    // Events kept per thread
+    constexpr std::size_t ring_capacity = std::size_t(1) << 16;
+
+    // 'name' and 'category' must be string literals, only the pointers are kept
+    struct event
+    {
+        const char *name;
+        const char *category;
+        clock::time_point begin;
+        clock::time_point end;
+    };
+
+    class recorder
+    {
+    public:
+        static recorder &instance()
+        {
+            static recorder r;
+            return r;
+        }
+
+        // The calling thread becomes "main", the first thread of the trace
+        void start()
+        {
+            local();
+            m_origin = clock::now();
+            m_active.store(true, std::memory_order_relaxed);
+        }
+
+        bool active() const { return m_active.load(std::memory_order_relaxed); }
+
+        void record(const char *name, const char *category, clock::time_point begin, clock::time_point end)
+        {
+            thread_buffer &buffer = local();
+            buffer.events[buffer.count++ % ring_capacity] = {name, category, begin, end};
+        }
+
+        // Writes all recorded events to 'fname', false if the file cannot be written
+        bool write(const std::string &fname)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            std::ofstream out(fname);
+            out << std::fixed << std::setprecision(3);
+            out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+
+            auto micros = [&](clock::time_point t)
+            { return std::chrono::duration<double, std::micro>(t - m_origin).count(); };
+
+            bool first = true;
+            for (std::size_t tid = 0; tid < m_buffers.size(); ++tid)
+            {
+                const thread_buffer &buffer = *m_buffers[tid];
+
+                out << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << tid
+                    << ", \"args\": {\"name\": \"" << (tid == 0 ? "main" : "thread " + std::to_string(tid)) << "\"}}";
+                first = false;
+
+                std::size_t kept = std::min(buffer.count, ring_capacity);
+                for (std::size_t i = buffer.count - kept; i < buffer.count; ++i)
+                {
+                    const event &e = buffer.events[i % ring_capacity];
+                    out << ",\n{\"name\": \"" << e.name << "\", \"cat\": \"" << e.category
+                        << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << tid
+                        << ", \"ts\": " << micros(e.begin) << ", \"dur\": " << micros(e.end) - micros(e.begin) << "}";
+                }
+            }
+
+            out << "\n]}\n";
+            return bool(out);
+        }
+
+    private:
+        struct thread_buffer
+        {
+            std::vector<event> events = std::vector<event>(ring_capacity);
+            std::size_t count = 0;
+        };
+
+        std::atomic<bool> m_active{false};
+        clock::time_point m_origin;
+        std::mutex m_mutex;
+        std::vector<std::unique_ptr<thread_buffer>> m_buffers;
+
+        recorder() = default;
+
+        // Buffer of the calling thread, registered on its first event
+        thread_buffer &local()
+        {
+            thread_local thread_buffer *buffer = nullptr;
+            if (!buffer)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_buffers.push_back(std::make_unique<thread_buffer>());
+                buffer = m_buffers.back().get();
+            }
+            return *buffer;
+        }
+    };
+
+    // Records the lifetime of the object as one event
+    class scope
+    {
+    public:
+        explicit scope(const char *name, const char *category = "ced")
+            : m_name(name), m_category(category), m_active(recorder::instance().active())
+        {
+            if (m_active)
+                m_begin = clock::now();
+        }
+
+        ~scope()
+        {
+            if (m_active)
+                recorder::instance().record(m_name, m_category, m_begin, clock::now());
+        }
+
+        scope(const scope &) = delete;
+        scope &operator=(const scope &) = delete;
+
+    private:
+        const char *m_name;
+        const char *m_category;
+        bool m_active;
+        clock::time_point m_begin;
+    };
+}
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+
+#include "simd.hpp"
+
+namespace tridiag
+{
+    /*
+     * Solves 'L' independent symmetric tridiagonal systems of size 'n' at once (Thomas algorithm).
+     *
+     * Storage is interleaved, value 'i' of system 'l' is stored at [i * L + l], so every step
+     * of the recurrence operates on a whole row of lanes and vectorises without gathers.
+     * 'diag' holds n rows, 'off' holds the n - 1 couplings between rows i and i + 1.
+     * The solution overwrites 'rhs', 'work' must have room for n * L values.
+     *
+     * The systems are expected to be diagonally dominant (as the AOS systems are),
+     * no pivoting is done.
+     */
+    template <typename T, std::size_t L = simd::lanes<T>>
+    void solve_batched(std::size_t n, const T *diag, const T *off, T *rhs, T *work)
+    {
+        if (n == 0)
+            return;
+
+        for (std::size_t l = 0; l < L; ++l)
+        {
+            T m = T(1) / diag[l];
+            work[l] = n > 1 ? off[l] * m : T(0);
+            rhs[l] *= m;
+        }
+
+        for (std::size_t i = 1; i < n; ++i)
+        {
+            const T *d = diag + i * L;
+            const T *o_prev = off + (i - 1) * L;
+            const T *w_prev = work + (i - 1) * L;
+            const T *r_prev = rhs + (i - 1) * L;
+            T *w = work + i * L;
+            T *r = rhs + i * L;
+
+            if (i + 1 < n)
+            {
+                const T *o = off + i * L;
+                for (std::size_t l = 0; l < L; ++l)
+                {
+                    T m = T(1) / (d[l] - o_prev[l] * w_prev[l]);
+                    w[l] = o[l] * m;
+                    r[l] = (r[l] - o_prev[l] * r_prev[l]) * m;
+                }
+            }
+            else
+            {
+                for (std::size_t l = 0; l < L; ++l)
+                {
+                    T m = T(1) / (d[l] - o_prev[l] * w_prev[l]);
+                    r[l] = (r[l] - o_prev[l] * r_prev[l]) * m;
+                }
+            }
+        }
+
+        for (std::size_t i = n - 1; i-- > 0;)
+        {
+            const T *w = work + i * L;
+            const T *r_next = rhs + (i + 1) * L;
+            T *r = rhs + i * L;
+
+            for (std::size_t l = 0; l < L; ++l)
+                r[l] -= w[l] * r_next[l];
+        }
+    }
+
+    // Diagonal of I - step * A from the (negative) off-diagonal, every row sums to one
+    template <typename T, std::size_t L = simd::lanes<T>>
+    void fill_diagonal(std::size_t n, const T *off, T *diag)
+    {
+        for (std::size_t l = 0; l < L; ++l)
+            diag[l] = T(1) - off[l];
+        for (std::size_t i = 1; i < n; ++i)
+            for (std::size_t l = 0; l < L; ++l)
+                diag[i * L + l] = T(1) - off[(i - 1) * L + l] - off[i * L + l];
+    }
+
+    /*
+     * Semi-implicit 1D diffusion along a family of lines, the building block of AOS schemes.
+     *
+     * Line 'j' element 'i' is located at [j * line_step + i * elem_step] in 'f' (input), 'g' (diffusivity)
+     * and 'out'. For every line the system (I - step * A(g)) x = f is solved and 'weight' * x is added to 'out'.
+     * Lines are processed in batches of 'L'; lanes past 'count' are padded with identity systems.
+     * 'buffer' must have room for 4 * n * L values.
+     */
+    template <typename T, std::size_t L = simd::lanes<T>>
+    void diffuse_lines(const T *f, const T *g, T *out,
+                       std::size_t n, std::size_t count,
+                       std::size_t elem_step, std::size_t line_step,
+                       T step, T weight, T *buffer)
+    {
+        T *diag = buffer;
+        T *off = diag + n * L;
+        T *rhs = off + n * L;
+        T *work = rhs + n * L;
+
+        for (std::size_t j0 = 0; j0 < count; j0 += L)
+        {
+            std::size_t active = std::min(L, count - j0);
+
+            for (std::size_t i = 0; i < n; ++i)
+                for (std::size_t l = 0; l < L; ++l)
+                {
+                    std::size_t idx = (j0 + l) * line_step + i * elem_step;
+                    bool valid = l < active;
+
+                    rhs[i * L + l] = valid ? f[idx] : T(0);
+                    off[i * L + l] = valid && i + 1 < n
+                                         ? -step * T(0.5) * (g[idx] + g[idx + elem_step])
+                                         : T(0);
+                }
+
+            fill_diagonal<T, L>(n, off, diag);
+            solve_batched<T, L>(n, diag, off, rhs, work);
+
+            for (std::size_t i = 0; i < n; ++i)
+                for (std::size_t l = 0; l < active; ++l)
+                    out[(j0 + l) * line_step + i * elem_step] += weight * rhs[i * L + l];
+        }
+    }
+
+    /*
+     * 'diffuse_lines' for data that is already interleaved: line 'j' element 'i' lane 'l' is
+     * located at [j * line_step + i * elem_step + l], e.g. the rows or columns of a stack of
+     * 'L' interleaved slices. No padding is needed, every batch is full.
+     */
+    template <typename T, std::size_t L = simd::lanes<T>>
+    void diffuse_interleaved(const T *f, const T *g, T *out,
+                             std::size_t n, std::size_t count,
+                             std::size_t elem_step, std::size_t line_step,
+                             T step, T weight, T *buffer)
+    {
+        T *diag = buffer;
+        T *off = diag + n * L;
+        T *rhs = off + n * L;
+        T *work = rhs + n * L;
+
+        for (std::size_t j = 0; j < count; ++j)
+        {
+            std::size_t base = j * line_step;
+
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                std::size_t idx = base + i * elem_step;
+                for (std::size_t l = 0; l < L; ++l)
+                {
+                    rhs[i * L + l] = f[idx + l];
+                    off[i * L + l] = i + 1 < n ? -step * T(0.5) * (g[idx + l] + g[idx + elem_step + l]) : T(0);
+                }
+            }
+
+            fill_diagonal<T, L>(n, off, diag);
+            solve_batched<T, L>(n, diag, off, rhs, work);
+
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                std::size_t idx = base + i * elem_step;
+                for (std::size_t l = 0; l < L; ++l)
+                    out[idx + l] += weight * rhs[i * L + l];
+            }
+        }
+    }
+}
@@ -0,0 +1,211 @@
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <fmt/core.h>
+#include <i3d/image3d.h>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std::literals;
+namespace po = boost::program_options;
+
+// program options (constants after 'parse_args' is called)
+std::string po_ced;
+std::string po_common;
+std::string po_reference = "--precision double --backend i3d"s;
+std::string po_candidate;
+double po_max_abs = std::numeric_limits<double>::infinity();
+double po_max_rmse = std::numeric_limits<double>::infinity();
+double po_min_psnr = 0.0;
+double po_max_coherence = std::numeric_limits<double>::infinity();
+double po_coherence_sigma = 1.0;
+double po_coherence_rho = 2.0;
+bool po_keep = false;
+bool po_quiet = false;
+std::string po_input_file;
+
+// make sure details are included after program opttions
+#include "details.hpp"
+#include "quality.hpp"
+#include "tiff_io.hpp"
+
+void parse_args(int argc, const char **argv)
+{
+	po::options_description desc("Options");
+	desc.add_options()("help,h", "print help message") // Help
+		("ced", po::value(&po_ced),
+		 "ced3dsplit executable ( default: next to this one )") // Executable
+		("common", po::value(&po_common),
+		 "Options passed to both runs, e.g. \"--iters 10 --sigma 0.5\"") // Common
+		("reference", po::value(&po_reference)->default_value(po_reference),
+		 "Options of the reference run") // Reference
+		("candidate", po::value(&po_candidate),
+		 "Options of the candidate run, e.g. \"--backend native --gauss young\" ( both runs "
+		 "write float results, --image_format is set by the harness )") // Candidate
+		("max_abs", po::value(&po_max_abs),
+		 "Fail if the maximum absolute error exceeds this") // Max abs
+		("max_rmse", po::value(&po_max_rmse),
+		 "Fail if the RMSE exceeds this") // Max RMSE
+		("min_psnr", po::value(&po_min_psnr)->default_value(po_min_psnr),
+		 "Fail if the PSNR ( dB, relative to the reference range ) is lower") // Min PSNR
+		("max_coherence", po::value(&po_max_coherence),
+		 "Fail if the mean absolute orientation coherence difference exceeds "
+		 "this") // Max coherence
+		("coherence_sigma", po::value(&po_coherence_sigma)->default_value(po_coherence_sigma),
+		 "Pre-smoothing of the coherence structure tensor") // Coherence sigma
+		("coherence_rho", po::value(&po_coherence_rho)->default_value(po_coherence_rho),
+		 "Integration scale of the coherence structure tensor") // Coherence rho
+		("keep",
+		 "Keep the outputs of both runs in the temporary directory") // Keep
+		("quiet",
+		 "Disable standard output") // Quiet
+		;
+	po::options_description hidden_desc;
+	hidden_desc.add_options() // Hidden
+		("input_file", po::value(&po_input_file),
+		 "Input file") // Input file
+		;
+
+	po::positional_options_description po_desc;
+	po_desc.add("input_file", 1);
+
+	po::options_description all_options;
+	all_options.add(desc).add(hidden_desc);
+
+	po::variables_map vm;
+	po::store(po::command_line_parser(argc, argv)
+				  .options(all_options)
+				  .positional(po_desc)
+				  .run(),
+			  vm);
+	po::notify(vm);
+
+	if (vm.count("help"))
+	{
+		std::cout << "Usage: ced3dsplit_validate [options] input_file\n"
+				  << "Runs ced3dsplit with the reference and the candidate options on the same input "
+					 "and compares the results, exits with 1 if a threshold is exceeded\n"
+				  << desc << std::endl;
+		std::exit(0);
+	}
+
+	if (vm.count("keep"))
+		po_keep = true;
+
+	if (vm.count("quiet"))
+		po_quiet = true;
+
+	if (po_input_file.empty() || po_candidate.empty())
+	{
+		std::cerr << "Input file and candidate options are required" << std::endl;
+		std::terminate();
+	}
+
+	if (po_ced.empty())
+		po_ced = (std::filesystem::path(argv[0]).parent_path() / "ced3dsplit").string();
+}
+
+/*
+ * Runs ced3dsplit with 'options' on the input, writing a float TIFF to 'output', and returns
+ * the wall time in seconds (process start-up and I/O included).
+ */
+double run(const std::string &options, const std::string &output)
+{
+	std::string command = fmt::format("\"{}\" {} {} --image_format float --quiet \"{}\" \"{}\"",
+									  po_ced, po_common, options, po_input_file, output);
+#ifdef _WIN32
+	// cmd.exe strips the outer quotes of a command that starts with one
+	command = "\"" + command + "\"";
+#endif
+
+	print(fmt::format("Running: {}", command));
+	auto begin = std::chrono::steady_clock::now();
+	if (std::system(command.c_str()) != 0)
+		throw std::runtime_error("ced3dsplit failed: " + command);
+
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+}
+
+int main(int argc, const char **argv)
+{
+	parse_args(argc, argv);
+
+	// Unique names, so concurrent validations do not overwrite each other's results
+	auto dir = std::filesystem::temp_directory_path();
+	std::string tag = fmt::format("{:016x}", std::random_device()() * 0x100000000ull + std::random_device()());
+	std::string reference_file = (dir / fmt::format("ced3dsplit_reference_{}.tif", tag)).string();
+	std::string candidate_file = (dir / fmt::format("ced3dsplit_candidate_{}.tif", tag)).string();
+
+	auto remove_outputs = [&]
+	{
+		if (po_keep)
+			return;
+		std::error_code ignored;
+		std::filesystem::remove(reference_file, ignored);
+		std::filesystem::remove(candidate_file, ignored);
+	};
+	if (po_keep)
+		print(fmt::format("Outputs: {} and {}", reference_file, candidate_file));
+
+	double reference_time = 0.0, candidate_time = 0.0;
+	i3d::Image3d<double> reference, candidate;
+	try
+	{
+		reference_time = run(po_reference, reference_file);
+		candidate_time = run(po_candidate, candidate_file);
+
+		tiff_io::read(reference_file.c_str(), reference);
+		tiff_io::read(candidate_file.c_str(), candidate);
+		if (reference.GetSize() != candidate.GetSize())
+			throw std::runtime_error("Reference and candidate results differ in size");
+	}
+	catch (...)
+	{
+		remove_outputs();
+		throw;
+	}
+
+	std::size_t w = reference.GetSizeX(), h = reference.GetSizeY(), d = reference.GetSizeZ();
+	auto diff = quality::compare(reference.GetFirstVoxelAddr(), candidate.GetFirstVoxelAddr(), reference.GetImageSize());
+
+	auto reference_coherence = quality::coherence(reference.GetFirstVoxelAddr(), w, h, d, po_coherence_sigma, po_coherence_rho);
+	auto candidate_coherence = quality::coherence(candidate.GetFirstVoxelAddr(), w, h, d, po_coherence_sigma, po_coherence_rho);
+	double coherence_mean = 0.0, coherence_max = 0.0;
+	for (std::size_t i = 0; i < reference_coherence.size(); ++i)
+	{
+		double e = std::abs(candidate_coherence[i] - reference_coherence[i]);
+		coherence_mean += e;
+		coherence_max = std::max(coherence_max, e);
+	}
+	coherence_mean /= double(std::max<std::size_t>(reference_coherence.size(), 1));
+
+	print(fmt::format("Reference: {:.3f} s, candidate: {:.3f} s, speedup {:.2f}x",
+					  reference_time, candidate_time, reference_time / candidate_time));
+	print(fmt::format("Max abs {:.4g}, RMSE {:.4g}, PSNR {:.2f} dB", diff.max_abs, diff.rmse, diff.psnr));
+	print(fmt::format("Coherence difference: mean {:.4g}, max {:.4g}", coherence_mean, coherence_max));
+
+	std::vector<std::string> failed;
+	if (diff.max_abs > po_max_abs)
+		failed.push_back(fmt::format("max abs {:.4g} > {:.4g}", diff.max_abs, po_max_abs));
+	if (diff.rmse > po_max_rmse)
+		failed.push_back(fmt::format("RMSE {:.4g} > {:.4g}", diff.rmse, po_max_rmse));
+	if (diff.psnr < po_min_psnr)
+		failed.push_back(fmt::format("PSNR {:.2f} dB < {:.2f} dB", diff.psnr, po_min_psnr));
+	if (coherence_mean > po_max_coherence)
+		failed.push_back(fmt::format("coherence difference {:.4g} > {:.4g}", coherence_mean, po_max_coherence));
+
+	remove_outputs();
+
+	for (const auto &f : failed)
+		std::cerr << "FAIL: " << f << std::endl;
+	if (failed.empty())
+		print("PASS");
+
+	return failed.empty() ? 0 : 1;
+}
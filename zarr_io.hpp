@@ -0,0 +1,370 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <i3d/image3d.h>
+#include <i3d/imgfiles.h>
+
+#include "codec.hpp"
+
+/*
+ * Zarr (v2) directory store.
+ *
+ * A store is a directory holding the JSON header ".zarray" and one file per chunk, named by
+ * its chunk indices ("z.y.x"), every chunk compressed on its own. Chunks are independent, so
+ * they are read and written by 'parallel_for' jobs and a VOI only touches the chunks it
+ * overlaps. Handles 8, 16 and 32 bit unsigned and 32 / 64 bit floating point little endian
+ * arrays, uncompressed or zlib compressed, in C order. The voxel size in microns is kept in
+ * ".zattrs" as "element_size_um" (z, y, x).
+ */
+namespace zarr_io
+{
+    namespace fs = std::filesystem;
+
+    // Edge of the cubic output chunks
+    constexpr std::size_t chunk_edge = 64;
+
+    // Layout of a store, sizes are (z, y, x)
+    struct array_info
+    {
+        std::array<std::size_t, 3> shape{};
+        std::array<std::size_t, 3> chunks{};
+        char kind = 0;
+        std::size_t bytes = 0;
+        bool compressed = false;
+        double fill_value = 0.0;
+        char separator = '.';
+        std::array<double, 3> element_size{1.0, 1.0, 1.0};
+    };
+
+    inline bool has_zarr_extension(const std::string &fname)
+    {
+        std::string ext = fname.substr(std::min(fname.size(), fname.rfind('.')));
+        std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c)
+                       { return char(std::tolower(c)); });
+        return ext == ".zarr";
+    }
+
+    inline bool is_store(const std::string &path)
+    {
+        return fs::is_regular_file(fs::path(path) / ".zarray");
+    }
+
+    inline array_info read_info(const std::string &path)
+    {
+        namespace pt = boost::property_tree;
+
+        pt::ptree header;
+        pt::read_json((fs::path(path) / ".zarray").string(), header);
+
+        auto triple = [](const pt::ptree &list, auto &out)
+        {
+            if (list.size() != 3)
+                throw std::runtime_error("Only 3D Zarr arrays are supported");
+
+            auto it = list.begin();
+            for (auto &v : out)
+                v = (it++)->second.get_value<std::remove_reference_t<decltype(v)>>();
+        };
+
+        array_info info;
+        triple(header.get_child("shape"), info.shape);
+        triple(header.get_child("chunks"), info.chunks);
+
+        std::string dtype = header.get<std::string>("dtype");
+        if (dtype.size() != 3 || dtype[0] == '>')
+            throw std::runtime_error("Unsupported Zarr dtype " + dtype);
+        info.kind = dtype[1];
+        info.bytes = std::size_t(dtype[2] - '0');
+
+        bool known = (info.kind == 'u' && (info.bytes == 1 || info.bytes == 2 || info.bytes == 4)) ||
+                     (info.kind == 'f' && (info.bytes == 4 || info.bytes == 8));
+        if (!known || (info.bytes > 1 && dtype[0] != '<'))
+            throw std::runtime_error("Unsupported Zarr dtype " + dtype);
+
+        if (header.get<std::string>("order", "C") != "C" || header.get<std::string>("filters", "null") != "null")
+            throw std::runtime_error("Only C ordered Zarr arrays without filters are supported");
+
+        const auto &compressor = header.get_child("compressor");
+        if (compressor.data() != "null")
+        {
+            if (compressor.get<std::string>("id") != "zlib")
+                throw std::runtime_error("Unsupported Zarr compressor " + compressor.get<std::string>("id"));
+            info.compressed = true;
+        }
+
+        // "NaN" and friends leave the fill value at 0
+        std::istringstream(header.get<std::string>("fill_value", "0")) >> info.fill_value;
+        info.separator = header.get<std::string>("dimension_separator", ".") == "/" ? '/' : '.';
+
+        if (fs::is_regular_file(fs::path(path) / ".zattrs"))
+        {
+            pt::ptree attrs;
+            pt::read_json((fs::path(path) / ".zattrs").string(), attrs);
+            if (auto size = attrs.get_child_optional("element_size_um"))
+                triple(*size, info.element_size);
+        }
+
+        for (std::size_t a = 0; a < 3; ++a)
+            if (info.chunks[a] == 0)
+                throw std::runtime_error("Invalid Zarr chunk shape");
+
+        return info;
+    }
+
+    // Size, voxel type and resolution of a store in the form i3d reports them for image files
+    inline i3d::ImageHeader read_header(const std::string &path)
+    {
+        array_info info = read_info(path);
+
+        // i3d has no unsigned 32 bit type, 'u4' is reported as its 32 bit integer type
+        i3d::ImgVoxelType type = info.bytes == 8 ? i3d::DoubleVoxel : i3d::FloatVoxel;
+        if (info.kind == 'u')
+            type = info.bytes == 1 ? i3d::Gray8Voxel : info.bytes == 2 ? i3d::Gray16Voxel : i3d::IntegerVoxel;
+
+        i3d::Vector3d<float> res(float(1.0 / info.element_size[2]), float(1.0 / info.element_size[1]),
+                                 float(1.0 / info.element_size[0]));
+        return i3d::ImageHeader(i3d::Vector3d<std::size_t>(info.shape[2], info.shape[1], info.shape[0]),
+                                type, i3d::Offset(), &res);
+    }
+
+    inline fs::path chunk_path(const std::string &path, const array_info &info,
+                               std::size_t cz, std::size_t cy, std::size_t cx)
+    {
+        std::string sep(1, info.separator);
+        return fs::path(path) / (std::to_string(cz) + sep + std::to_string(cy) + sep + std::to_string(cx));
+    }
+
+    // Converts 'count' samples of the store's dtype at 'src' to T
+    template <typename T>
+    void convert(const array_info &info, const unsigned char *src, T *dst, std::size_t count)
+    {
+        auto cast = [&](auto *typed)
+        {
+            for (std::size_t i = 0; i < count; ++i)
+                dst[i] = T(typed[i]);
+        };
+
+        if (info.kind == 'f')
+        {
+            if (info.bytes == 4)
+                cast(reinterpret_cast<const float *>(src));
+            else
+                cast(reinterpret_cast<const double *>(src));
+        }
+        else if (info.bytes == 1)
+            cast(src);
+        else if (info.bytes == 2)
+            cast(reinterpret_cast<const std::uint16_t *>(src));
+        else
+            cast(reinterpret_cast<const std::uint32_t *>(src));
+    }
+
+    /*
+     * Reads the store at 'path' into 'out', restricted to 'voi' if given. 'out' gets the stored
+     * values converted to T, resolution and offset are not set. Every chunk overlapping the
+     * region is read and decoded by its own 'parallel_for' task, missing chunks hold the fill value.
+     */
+    template <typename T, typename F>
+    void read(const std::string &path, i3d::Image3d<T> &out, const i3d::VOI<i3d::PIXELS> *voi, F &&parallel_for)
+    {
+        array_info info = read_info(path);
+        const auto &shape = info.shape;
+        const auto &chunks = info.chunks;
+
+        // region as (z, y, x)
+        std::array<std::size_t, 3> r0{0, 0, 0}, rs = shape;
+        if (voi)
+        {
+            r0 = {std::size_t(voi->offset.z), std::size_t(voi->offset.y), std::size_t(voi->offset.x)};
+            rs = {voi->size.z, voi->size.y, voi->size.x};
+        }
+
+        for (std::size_t a = 0; a < 3; ++a)
+            if (r0[a] + rs[a] > shape[a])
+                throw std::out_of_range("VOI exceeds the Zarr array");
+
+        out.MakeRoom(rs[2], rs[1], rs[0]);
+        if (rs[0] == 0 || rs[1] == 0 || rs[2] == 0)
+            return;
+
+        std::array<std::size_t, 3> first, count;
+        for (std::size_t a = 0; a < 3; ++a)
+        {
+            first[a] = r0[a] / chunks[a];
+            count[a] = (r0[a] + rs[a] - 1) / chunks[a] + 1 - first[a];
+        }
+
+        T *data = out.GetFirstVoxelAddr();
+        std::size_t chunk_bytes = chunks[0] * chunks[1] * chunks[2] * info.bytes;
+
+        parallel_for(count[0] * count[1] * count[2], [&](std::size_t i)
+                     {
+                         std::array<std::size_t, 3> c{first[0] + i / (count[1] * count[2]),
+                                                      first[1] + i / count[2] % count[1],
+                                                      first[2] + i % count[2]};
+
+                         // overlap of the chunk and the region, in array coordinates
+                         std::array<std::size_t, 3> s, e;
+                         for (std::size_t a = 0; a < 3; ++a)
+                         {
+                             s[a] = std::max(c[a] * chunks[a], r0[a]);
+                             e[a] = std::min((c[a] + 1) * chunks[a], r0[a] + rs[a]);
+                         }
+
+                         std::ifstream file(chunk_path(path, info, c[0], c[1], c[2]), std::ios::binary);
+                         if (!file)
+                         {
+                             for (std::size_t z = s[0]; z < e[0]; ++z)
+                                 for (std::size_t y = s[1]; y < e[1]; ++y)
+                                     std::fill_n(data + ((z - r0[0]) * rs[1] + y - r0[1]) * rs[2] + s[2] - r0[2],
+                                                 e[2] - s[2], T(info.fill_value));
+                             return;
+                         }
+
+                         std::vector<unsigned char> stored((std::istreambuf_iterator<char>(file)),
+                                                           std::istreambuf_iterator<char>());
+                         std::vector<unsigned char> raw;
+                         if (info.compressed)
+                         {
+                             raw.resize(chunk_bytes);
+                             codec::decompress(stored.data(), stored.size(), raw.data(), raw.size());
+                         }
+                         else if (stored.size() == chunk_bytes)
+                             raw.swap(stored);
+                         else
+                             throw std::runtime_error("Zarr chunk has a wrong size");
+
+                         for (std::size_t z = s[0]; z < e[0]; ++z)
+                             for (std::size_t y = s[1]; y < e[1]; ++y)
+                             {
+                                 std::size_t src = (((z - c[0] * chunks[0]) * chunks[1] + y - c[1] * chunks[1]) * chunks[2] +
+                                                    s[2] - c[2] * chunks[2]) *
+                                                   info.bytes;
+                                 convert(info, raw.data() + src,
+                                         data + ((z - r0[0]) * rs[1] + y - r0[1]) * rs[2] + s[2] - r0[2], e[2] - s[2]);
+                             }
+                     });
+    }
+
+    template <typename T>
+    std::string dtype()
+    {
+        if constexpr (std::is_same_v<T, std::uint8_t>)
+            return "|u1";
+        else if constexpr (std::is_same_v<T, std::uint16_t>)
+            return "<u2";
+        else if constexpr (std::is_same_v<T, float>)
+            return "<f4";
+        else
+        {
+            static_assert(std::is_same_v<T, double>, "Unsupported voxel type");
+            return "<f8";
+        }
+    }
+
+    /*
+     * Writes 'img' (or just its 'voi') as a store at 'path' with cubic chunks of 'chunk_edge'
+     * voxels, zlib compressed at 'level' (0 stores them uncompressed). Every chunk is
+     * compressed and written by its own 'parallel_for' task.
+     */
+    template <typename T, typename F>
+    void write(const std::string &path, const i3d::Image3d<T> &img, const i3d::VOI<i3d::PIXELS> *voi,
+               int level, F &&parallel_for)
+    {
+        std::size_t x0 = 0, y0 = 0, z0 = 0, w = img.GetSizeX(), h = img.GetSizeY(), d = img.GetSizeZ();
+        if (voi)
+        {
+            x0 = voi->offset.x, y0 = voi->offset.y, z0 = voi->offset.z;
+            w = voi->size.x, h = voi->size.y, d = voi->size.z;
+        }
+
+        array_info info;
+        info.shape = {d, h, w};
+        info.chunks = {std::min(chunk_edge, std::max<std::size_t>(d, 1)),
+                       std::min(chunk_edge, std::max<std::size_t>(h, 1)),
+                       std::min(chunk_edge, std::max<std::size_t>(w, 1))};
+
+        fs::create_directories(path);
+
+        auto res = img.GetResolution().GetRes();
+        std::ofstream zarray(fs::path(path) / ".zarray");
+        zarray
+            << "{\n"
+            << "    \"zarr_format\": 2,\n"
+            << "    \"shape\": [" << d << ", " << h << ", " << w << "],\n"
+            << "    \"chunks\": [" << info.chunks[0] << ", " << info.chunks[1] << ", " << info.chunks[2] << "],\n"
+            << "    \"dtype\": \"" << dtype<T>() << "\",\n"
+            << "    \"compressor\": "
+            << (level == 0 ? "null" : "{\"id\": \"zlib\", \"level\": " + std::to_string(level) + "}") << ",\n"
+            << "    \"fill_value\": 0,\n"
+            << "    \"order\": \"C\",\n"
+            << "    \"filters\": null,\n"
+            << "    \"dimension_separator\": \".\"\n"
+            << "}\n";
+        zarray.close();
+        if (!zarray)
+            throw std::runtime_error("Failed to write Zarr header");
+
+        if (res.x > 0 && res.y > 0 && res.z > 0)
+        {
+            std::ofstream zattrs(fs::path(path) / ".zattrs");
+            zattrs
+                << "{\n"
+                << "    \"element_size_um\": [" << 1.0 / res.z << ", " << 1.0 / res.y << ", " << 1.0 / res.x << "]\n"
+                << "}\n";
+            zattrs.close();
+            if (!zattrs)
+                throw std::runtime_error("Failed to write Zarr attributes");
+        }
+        else
+            fs::remove(fs::path(path) / ".zattrs");
+
+        std::array<std::size_t, 3> count;
+        for (std::size_t a = 0; a < 3; ++a)
+            count[a] = (info.shape[a] + info.chunks[a] - 1) / info.chunks[a];
+
+        const T *data = img.GetFirstVoxelAddr();
+        std::size_t sx = img.GetSizeX(), sy = img.GetSizeY();
+        const auto &chunks = info.chunks;
+
+        parallel_for(count[0] * count[1] * count[2], [&](std::size_t i)
+                     {
+                         std::array<std::size_t, 3> o{i / (count[1] * count[2]) * chunks[0],
+                                                      i / count[2] % count[1] * chunks[1],
+                                                      i % count[2] * chunks[2]};
+
+                         // edge chunks are padded with zeros to the full chunk size
+                         std::vector<T> chunk(chunks[0] * chunks[1] * chunks[2], T(0));
+                         std::size_t cw = std::min(chunks[2], w - o[2]);
+                         for (std::size_t z = o[0]; z < std::min(o[0] + chunks[0], d); ++z)
+                             for (std::size_t y = o[1]; y < std::min(o[1] + chunks[1], h); ++y)
+                                 std::copy_n(data + ((z0 + z) * sy + y0 + y) * sx + x0 + o[2], cw,
+                                             chunk.data() + ((z - o[0]) * chunks[1] + y - o[1]) * chunks[2]);
+
+                         const auto *raw = reinterpret_cast<const unsigned char *>(chunk.data());
+                         std::size_t raw_size = chunk.size() * sizeof(T);
+                         std::vector<unsigned char> stored = level == 0 ? std::vector<unsigned char>(raw, raw + raw_size)
+                                                                        : codec::compress(raw, raw_size, level);
+
+                         std::ofstream file(chunk_path(path, info, o[0] / chunks[0], o[1] / chunks[1], o[2] / chunks[2]),
+                                            std::ios::binary | std::ios::trunc);
+                         if (!file.write(reinterpret_cast<const char *>(stored.data()), std::streamsize(stored.size())))
+                             throw std::runtime_error("Failed to write Zarr chunk");
+                     });
+    }
+}